@@ -4,6 +4,7 @@
 #include <arch/idt.h>
 #include <arch/smp.h>
 #include <lib/string.h>
+#include <mm/vmm.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <sys/kpanic.h>
@@ -36,6 +37,15 @@ void syscall_handler(struct register_ctx* ctx) {
     ctx->rax = status;
 }
 
+/* Faults on lazy regions are demand paging, everything else is fatal */
+void page_fault_handler(struct register_ctx* ctx) {
+    pcb_t* proc = sched_get_current();
+    if (proc && proc->vctx && vfault(proc->vctx, ctx->cr2, ctx->err))
+        return;
+
+    kpanic(ctx, NULL);
+}
+
 void idt_default_interrupt_handler(struct register_ctx* ctx) {
     kpanic(ctx, NULL);
 }
@@ -70,6 +80,10 @@ void idt_init() {
         idt_set_gate(i, stubs[i], IDT_INTERRUPT_GATE);
     }
 
+    /* Interrupts stay off until the stub has saved CR2 */
+    idt_set_gate(14, stubs[14], IDT_INTERRUPT_GATE);
+    real_handlers[14] = page_fault_handler;
+
     idt_set_gate(0x80, stubs[0x80], IDT_INTERRUPT_GATE | GDT_ACCESS_RING3);
     real_handlers[0x80] = syscall_handler;
 
@@ -1,8 +1,12 @@
 /* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
+#include <arch/idt.h>
 #include <arch/paging.h>
+#include <arch/smp.h>
 #include <boot/emk.h>
 #include <lib/string.h>
 #include <mm/pmm.h>
+#include <sys/apic/lapic.h>
 #include <sys/kpanic.h>
 #include <util/align.h>
 #include <util/log.h>
@@ -26,69 +30,196 @@ static inline uint64_t page_index(uint64_t virt, uint64_t shift) {
     return (virt >> shift) & PAGE_INDEX_MASK;
 }
 
-/* Helper: Get page table entry, return NULL if not present */
+/* Large page, PCID and global page support, probed once by paging_init() */
+static bool has_large_2m;
+static bool has_large_1g;
+static bool has_pcid;
+static bool has_pge;
+
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
+/* Helper: Drop every non-global translation of the loaded PCID */
+static inline void tlb_flush_all(void) {
+    uint64_t cr3;
+    __asm__ volatile("movq %%cr3, %0\n\t"
+                     "movq %0, %%cr3"
+                     : "=r"(cr3)
+                     :
+                     : "memory");
+}
+
+/* Helper: Drop every translation of this CPU, global ones and other PCIDs' */
+static inline void tlb_flush_global(void) {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+}
+
+/* Helper: Kernel half pages are global, every pagemap maps them the same */
+static inline uint64_t leaf_flags(uint64_t virt, uint64_t flags) {
+    if (has_pge && virt >= VPM_USER_END) {
+        return flags | VMM_GLOBAL;
+    }
+    return flags;
+}
+
+/*
+ * Page table pages count their entries in their page reference: one for the
+ * table itself plus one per non-zero entry, PML4s only count their lower
+ * half. Anything writing an entry takes its reference, the HHDM included.
+ * Lower half tables are freed as soon as they empty, the kernel half's are
+ * shared and stay.
+ */
+static uint64_t table_pages; // In use, pagemaps included
+
+static uint64_t* table_alloc(void) {
+    uint64_t* table = palloc(1, true);
+    if (table) {
+        __atomic_add_fetch(&table_pages, 1, __ATOMIC_RELAXED);
+    }
+    return table;
+}
+
+static inline void table_get(uint64_t* table) {
+    pmm_page_get((uint64_t)PHYSICAL(table));
+}
+
+/* Helper: Drop a reference to table, freeing it with the last one */
+static void table_put(uint64_t* table) {
+    if (pmm_page_unref((uint64_t)PHYSICAL(table))) {
+        pfree(PHYSICAL(table), 1);
+        __atomic_sub_fetch(&table_pages, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline bool table_empty(uint64_t* table) {
+    return pmm_page_refs((uint64_t)PHYSICAL(table)) == 1;
+}
+
+uint64_t pmtables(void) {
+    return __atomic_load_n(&table_pages, __ATOMIC_RELAXED);
+}
+
+/* Helper: Get page table entry, return NULL if not present or a large page */
 static inline uint64_t* get_table(uint64_t* table, uint64_t index) {
-    if (!table || !(table[index] & VMM_PRESENT)) {
+    if (!table || !(table[index] & VMM_PRESENT) ||
+        (table[index] & VMM_LARGE)) {
         return NULL;
     }
     return (uint64_t*)HIGHER_HALF(table[index] & PAGE_MASK);
 }
 
-/* Helper: Get or allocate a page table */
+/*
+ * Helper: Break the large page at table[index], whose entries map 1 << shift
+ * bytes each, into a table of 512 pages of the next size down.
+ */
+static bool split_large(uint64_t* table, uint64_t index, uint64_t shift) {
+    uint64_t* new_table = table_alloc();
+    if (!new_table) {
+        return false;
+    }
+
+    uint64_t base = table[index] & PAGE_MASK & ~((1ULL << shift) - 1);
+    uint64_t attrs = table[index] & ~PAGE_MASK;
+    uint64_t step = 1ULL << (shift - 9);
+    if (step == PAGE_SIZE) {
+        attrs &= ~VMM_LARGE;
+    }
+
+    for (uint64_t i = 0; i <= PAGE_INDEX_MASK; i++) {
+        new_table[i] = (base + i * step) | attrs;
+        table_get(new_table);
+    }
+
+    table[index] = (uint64_t)PHYSICAL(new_table) | 0b111;
+    tlb_flush_all();
+    return true;
+}
+
+/* Helper: Get or allocate a page table, shift as for split_large() */
 static inline uint64_t* get_or_alloc_table(uint64_t* table, uint64_t index,
-                                           uint64_t flags) {
+                                           uint64_t flags, uint64_t shift) {
     if (!table) {
         return NULL;
     }
     if (!(table[index] & VMM_PRESENT)) {
-        uint64_t* new_table = palloc(1, true);
+        uint64_t* new_table = table_alloc();
         if (!new_table || !IS_PAGE_ALIGNED((uint64_t)new_table)) {
             return NULL;
         }
-        memset(new_table, 0, PAGE_SIZE);
         table[index] = (uint64_t)PHYSICAL(new_table) | 0b111;
+        table_get(table);
+    } else if (table[index] & VMM_LARGE) {
+        if (!split_large(table, index, shift)) {
+            return NULL;
+        }
     }
-    table[index] |= flags & 0xFF;
+    table[index] |= flags & 0xFF & ~VMM_LARGE;
     return (uint64_t*)HIGHER_HALF(table[index] & PAGE_MASK);
 }
 
-/* Translate virtual to physical address */
-uint64_t virt_to_phys(uint64_t* pagemap, uint64_t virt) {
-    if (!pagemap) {
-        return 0;
+/*
+ * Find the entry mapping virt: the PML2 one if it's in a 2M page, else the
+ * PML1 one. NULL if a table on the way is missing or virt is in a 1G page.
+ */
+uint64_t* vpte(uint64_t* pagemap, uint64_t virt) {
+    uint64_t* pml3 = get_table(pagemap, page_index(virt, PML4_SHIFT));
+    uint64_t* pml2 = get_table(pml3, page_index(virt, PML3_SHIFT));
+    if (!pml2) {
+        return NULL;
     }
 
-    uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
-    uint64_t* pml3 = get_table(pagemap, pml4_idx);
-    if (!pml3) {
-        return 0;
+    uint64_t* pml2e = &pml2[page_index(virt, PML2_SHIFT)];
+    if ((*pml2e & VMM_PRESENT) && (*pml2e & VMM_LARGE)) {
+        return pml2e;
     }
 
-    uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
-    uint64_t* pml2 = get_table(pml3, pml3_idx);
-    if (!pml2) {
-        return 0;
+    uint64_t* pml1 = get_table(pml2, page_index(virt, PML2_SHIFT));
+    if (!pml1) {
+        return NULL;
     }
+    return &pml1[page_index(virt, PML1_SHIFT)];
+}
 
-    uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
-    uint64_t* pml1 = get_table(pml2, pml2_idx);
-    if (!pml1) {
+/* Translate virtual to physical address, of the 4K page containing it */
+uint64_t virt_to_phys(uint64_t* pagemap, uint64_t virt) {
+    uint64_t* pml3 = get_table(pagemap, page_index(virt, PML4_SHIFT));
+    if (!pml3) {
         return 0;
     }
 
-    uint64_t pml1_idx = page_index(virt, PML1_SHIFT);
-    if (!(pml1[pml1_idx] & VMM_PRESENT)) {
+    uint64_t entry = pml3[page_index(virt, PML3_SHIFT)];
+    uint64_t size = PAGE_SIZE_1G;
+    if (entry & VMM_PRESENT && !(entry & VMM_LARGE)) {
+        uint64_t* pml2 = (uint64_t*)HIGHER_HALF(entry & PAGE_MASK);
+        entry = pml2[page_index(virt, PML2_SHIFT)];
+        size = PAGE_SIZE_2M;
+    }
+    if (entry & VMM_PRESENT && !(entry & VMM_LARGE)) {
+        uint64_t* pml1 = (uint64_t*)HIGHER_HALF(entry & PAGE_MASK);
+        entry = pml1[page_index(virt, PML1_SHIFT)];
+        size = PAGE_SIZE;
+    }
+    if (!(entry & VMM_PRESENT)) {
         return 0;
     }
 
-    return pml1[pml1_idx] & PAGE_MASK;
+    return (entry & PAGE_MASK & ~(size - 1)) +
+           (virt & (size - 1) & ~(PAGE_SIZE - 1));
 }
 
-/* Set active pagemap (load CR3) */
+/* Set active pagemap (load CR3), under PCID 0 which this always flushes */
 void pmset(uint64_t* pagemap) {
     if (!pagemap || !IS_PAGE_ALIGNED((uint64_t)PHYSICAL(pagemap))) {
         kpanic(NULL, "Invalid pagemap, %p", pagemap);
     }
+
+    cpu_local_t* cpu = cpu_local_try();
+    if (cpu) {
+        cpu->pcid = 0;
+        __atomic_store_n(&cpu->pagemap, pagemap, __ATOMIC_SEQ_CST);
+    }
     __asm__ volatile("movq %0, %%cr3" ::"r"((uint64_t)PHYSICAL(pagemap))
                      : "memory");
 }
@@ -97,220 +228,661 @@ void pmset(uint64_t* pagemap) {
 uint64_t* pmget(void) {
     uint64_t cr3;
     __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
-    return (uint64_t*)HIGHER_HALF(cr3);
+    return (uint64_t*)HIGHER_HALF(cr3 & PAGE_MASK);
+}
+
+/*
+ * Switch to ctx's pagemap. With PCIDs every CPU keeps the TLB entries of its
+ * last PCID_SLOTS contexts apart, so switching back to one of them doesn't
+ * start from a cold TLB. Slots are keyed on the context id, which is never
+ * reused, so a recycled pagemap can't pick up another's entries.
+ */
+void vswitch(vctx_t* ctx) {
+    cpu_local_t* cpu = has_pcid ? cpu_local_try() : NULL;
+    if (!cpu) {
+        pmset(ctx->pagemap);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+
+    /* Published before stale is checked, see tlb_flush() */
+    __atomic_store_n(&cpu->pagemap, ctx->pagemap, __ATOMIC_SEQ_CST);
+
+    uint32_t slot = 0;
+    while (slot < PCID_SLOTS && cpu->pcids[slot].ctx_id != ctx->id) {
+        slot++;
+    }
+
+    bool flush = true;
+    if (slot == PCID_SLOTS) {
+        slot = cpu->pcid_next;
+        cpu->pcid_next = (slot + 1) % PCID_SLOTS;
+        cpu->pcids[slot].ctx_id = ctx->id;
+        cpu->pcids[slot].pagemap = ctx->pagemap;
+        __atomic_store_n(&cpu->pcids[slot].stale, false, __ATOMIC_SEQ_CST);
+    } else {
+        flush = __atomic_exchange_n(&cpu->pcids[slot].stale, false,
+                                    __ATOMIC_SEQ_CST);
+    }
+
+    uint64_t cr3 = (uint64_t)PHYSICAL(ctx->pagemap) | (slot + 1);
+    if (!flush) {
+        cr3 |= CR3_NOFLUSH;
+    }
+
+    cpu->pcid = slot + 1;
+    __asm__ volatile("movq %0, %%cr3" ::"r"(cr3) : "memory");
+    irq_restore(flags);
 }
 
-/* Create  new pagemap */
+/*
+ * Create new pagemap. The upper half is shared with the kernel pagemap by
+ * pointing at the same PML3 tables, see paging_init().
+ */
 uint64_t* pmnew(void) {
-    uint64_t* pm = (uint64_t*)palloc(1, true);
+    uint64_t* pm = table_alloc();
     if (pm == NULL) {
         kpanic(NULL, "Failed to allocate page for new pagemap.");
         return NULL;
     }
-    memset(pm, 0, PAGE_SIZE);
     if (kernel_pagemap) {
         memcpy(pm + 256, kernel_pagemap + 256, 256 * sizeof(uint64_t));
     }
     return pm;
 }
 
-/* Map virtual to physical address (large 2M pages) */
-#if LARGE_PAGES
-bool _supports_large_pages() {
-    uint32_t eax, ebx, ecx, edx;
-    __asm__ volatile("cpuid"
-                     : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
-                     : "a"(1));
-    return (edx & (1 << 3)); // PSE (bit 3) = 2M page support
+/* Helper: Drop a table and all below it, level 1 being a PML1 */
+static void table_destroy(uint64_t* table, int level) {
+    for (uint64_t i = 0; i <= PAGE_INDEX_MASK; i++) {
+        if (!table[i]) {
+            continue;
+        }
+        if (level > 1 && (table[i] & VMM_PRESENT) &&
+            !(table[i] & VMM_LARGE)) {
+            table_destroy((uint64_t*)HIGHER_HALF(table[i] & PAGE_MASK),
+                          level - 1);
+        }
+        table_put(table);
+    }
+    table_put(table);
 }
 
-int vmap_large(uint64_t* pagemap, uint64_t virt, uint64_t phys,
-               uint64_t flags) {
-    if (!pagemap || (virt & (PAGE_SIZE_2M - 1)) || (phys & (PAGE_SIZE_2M - 1)))
-        return -1;
+/*
+ * Free pagemap and its lower half tables. The pages they map are the
+ * owner's business, see vdestroy(). No other CPU may have it loaded.
+ */
+void pmfree(uint64_t* pagemap) {
+    if (!pagemap || pagemap == kernel_pagemap) {
+        return;
+    }
 
-    if (!_supports_large_pages()) {
-        log_early(
-            "error: vmap_large() is unsupported: 2MB pages not supported!");
-        return -1;
+    cpu_local_t* self = cpu_local_try();
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (&cpu_locals[i] != self && cpu_locals[i].pagemap == pagemap) {
+            kpanic(NULL, "Freeing pagemap %p, live on CPU %u", pagemap, i);
+        }
+    }
+    if (pmget() == pagemap) {
+        pmset(kernel_pagemap);
+    }
+
+    for (uint64_t i = 0; i < 256; i++) {
+        uint64_t* pml3 = get_table(pagemap, i);
+        if (pml3) {
+            table_destroy(pml3, 3);
+            table_put(pagemap);
+        }
     }
+    table_put(pagemap);
+}
 
+/* Above this many pages reloading CR3 is cheaper than one invlpg each */
+#define TLB_FLUSH_MAX 32
+
+/* Whether the CPU walks pagemap's tables for virt, directly or shared */
+static inline bool pm_live(uint64_t* pagemap, uint64_t virt) {
+    uint64_t* live = pmget();
     uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
-    uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
-    uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
+    return pagemap == live || pagemap[pml4_idx] == live[pml4_idx];
+}
 
-    uint64_t* pml3 = get_or_alloc_table(pagemap, pml4_idx, flags);
-    if (!pml3)
-        return -1;
+/*
+ * Mark the PCIDs caching pagemap, or every one if NULL, stale on all CPUs
+ * so they start cold next time they're switched to. The one this CPU runs
+ * under is left to the caller, a CPU running one of the others needs telling
+ * separately.
+ */
+static void pcid_forget(uint64_t* pagemap) {
+    cpu_local_t* self = has_pcid ? cpu_local_try() : NULL;
+    if (!self) {
+        return;
+    }
 
-    uint64_t* pml2 = get_or_alloc_table(pml3, pml3_idx, flags);
-    if (!pml2)
-        return -1;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        for (uint32_t slot = 0; slot < PCID_SLOTS; slot++) {
+            pcid_slot_t* pcid = &cpu_locals[i].pcids[slot];
+            if (&cpu_locals[i] == self && slot + 1 == self->pcid) {
+                continue;
+            }
+            if (!pagemap || pcid->pagemap == pagemap) {
+                __atomic_store_n(&pcid->stale, true, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+}
 
-    // Set large page (PS bit = 1 << 7)
-    pml2[pml2_idx] = phys | flags | (1ULL << 7);
-    __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
-    return 0;
+/* Helper: Drop this CPU's translations for a range */
+static void tlb_invalidate(bool kernel, uint64_t virt, uint64_t pages) {
+    if (pages > TLB_FLUSH_MAX && kernel && has_pge) {
+        tlb_flush_global();
+    } else if (pages > TLB_FLUSH_MAX) {
+        tlb_flush_all();
+    } else {
+        for (uint64_t i = 0; i < pages; i++) {
+            __asm__ volatile("invlpg (%0)" ::"r"(virt + i * PAGE_SIZE)
+                             : "memory");
+        }
+    }
 }
-#else  // LARGE_PAGES
-bool _supports_large_pages() {
-    log_early("warning: Large pages are disabled in the kernel");
-    return false;
+
+/*
+ * TLB shootdown. Every CPU has a queue of ranges that others changed under
+ * it. A sender queues its range on each CPU that has the pagemap loaded, or
+ * on all of them for the kernel half, and sends an IPI only if the queue
+ * was empty, so a burst of changes costs one IPI per CPU. A full queue turns
+ * into a full flush. The sender then waits until every target has handled
+ * its ticket, working through its own queue meanwhile so two CPUs shooting
+ * at each other can't deadlock. A target spinning on a lock with IRQs off,
+ * maybe one the sender holds, answers from its spin loop via tlb_poll().
+ */
+#define TLB_SHOOTDOWN_VECTOR 0xFD
+
+static void tlb_drain(cpu_local_t* cpu) {
+    tlb_request_t reqs[TLB_QUEUE_SIZE];
+
+    spinlock_acquire_raw(&cpu->tlb_lock);
+    uint64_t ticket = cpu->tlb_sent;
+    uint32_t count = cpu->tlb_queued;
+    bool overflow = cpu->tlb_overflow;
+    memcpy(reqs, cpu->tlb_queue, count * sizeof(tlb_request_t));
+    cpu->tlb_queued = 0;
+    cpu->tlb_overflow = false;
+    spinlock_release(&cpu->tlb_lock);
+
+    if (ticket == cpu->tlb_done) {
+        return;
+    }
+
+    if (overflow && has_pge) {
+        tlb_flush_global();
+    } else if (overflow) {
+        tlb_flush_all();
+    } else {
+        /* A pagemap switched away from since is stale in its PCID already */
+        for (uint32_t i = 0; i < count; i++) {
+            bool kernel = !reqs[i].pagemap;
+            if (kernel || reqs[i].pagemap == cpu->pagemap) {
+                tlb_invalidate(kernel, reqs[i].virt, reqs[i].pages);
+            }
+        }
+    }
+
+    __atomic_store_n(&cpu->tlb_done, ticket, __ATOMIC_RELEASE);
 }
 
-int vmap_large(uint64_t*, uint64_t, uint64_t, uint64_t) { return -1; }
-#endif // LARGE_PAGES
+void tlb_poll(void) {
+    cpu_local_t* cpu = cpu_local_try();
+    if (cpu && __atomic_load_n(&cpu->tlb_done, __ATOMIC_ACQUIRE) !=
+                   __atomic_load_n(&cpu->tlb_sent, __ATOMIC_ACQUIRE)) {
+        tlb_drain(cpu);
+    }
+}
 
-/* Map virtual to physical address */
-int vmap(uint64_t* pagemap, uint64_t virt, uint64_t phys, uint64_t flags) {
+static void tlb_shootdown_handler(struct register_ctx* ctx) {
+    (void)ctx;
+    tlb_drain(get_cpu_local());
+    lapic_eoi();
+}
+
+/* Helper: Make the CPUs running pagemap, all if NULL, drop a range */
+static void tlb_shootdown(cpu_local_t* self, uint64_t* pagemap, uint64_t virt,
+                          uint64_t pages) {
+    uint64_t tickets[MAX_CPUS] = {0};
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        cpu_local_t* cpu = &cpu_locals[i];
+        if (cpu == self || !__atomic_load_n(&cpu->ready, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        if (pagemap &&
+            __atomic_load_n(&cpu->pagemap, __ATOMIC_SEQ_CST) != pagemap) {
+            continue;
+        }
+
+        spinlock_acquire_raw(&cpu->tlb_lock);
+        bool pending = cpu->tlb_queued || cpu->tlb_overflow;
+        if (cpu->tlb_queued < TLB_QUEUE_SIZE) {
+            cpu->tlb_queue[cpu->tlb_queued++] =
+                (tlb_request_t){pagemap, virt, pages};
+        } else {
+            cpu->tlb_overflow = true;
+        }
+        tickets[i] = ++cpu->tlb_sent;
+        spinlock_release(&cpu->tlb_lock);
+
+        if (!pending) {
+            lapic_send_ipi(cpu->lapic_id, TLB_SHOOTDOWN_VECTOR, ICR_FIXED,
+                           ICR_PHYSICAL, ICR_NO_SHORTHAND);
+        }
+    }
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        while (tickets[i] &&
+               __atomic_load_n(&cpu_locals[i].tlb_done, __ATOMIC_ACQUIRE) <
+                   tickets[i]) {
+            tlb_drain(self);
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+/*
+ * Drop stale translations for a range after its PTEs changed, here and on
+ * every other CPU that may hold them. A CPU that switches to pagemap after
+ * the PTEs changed either is seen here and shot down, or sees its PCID
+ * marked stale and flushes, as both sides publish before they check.
+ */
+static void tlb_flush(uint64_t* pagemap, uint64_t virt, uint64_t pages) {
+    uint64_t flags = irq_save();
+    bool kernel = virt >= VPM_USER_END;
+
+    /*
+     * The upper half is shared, every PCID may have cached it. Its pages are
+     * global though, and invlpg drops a global page under every PCID.
+     */
+    if (!kernel) {
+        pcid_forget(pagemap);
+    } else if (!has_pge) {
+        pcid_forget(NULL);
+    }
+
+    uint64_t last = virt + (pages - 1) * PAGE_SIZE;
+    if (pm_live(pagemap, virt) || pm_live(pagemap, last)) {
+        tlb_invalidate(kernel, virt, pages);
+    }
+
+    cpu_local_t* self = cpu_local_try();
+    if (self) {
+        tlb_shootdown(self, kernel ? NULL : pagemap, virt, pages);
+    }
+
+    irq_restore(flags);
+}
+
+/*
+ * Map pages contiguous pages. The tables are walked once per PML1 and only
+ * entries that were present before need flushing, the CPU never caches a
+ * missing one.
+ */
+int vmap_range(uint64_t* pagemap, uint64_t virt, uint64_t phys,
+               uint64_t pages, uint64_t flags) {
     if (!pagemap) {
         return -1;
     }
 
-    uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
-    uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
-    uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
-    uint64_t pml1_idx = page_index(virt, PML1_SHIFT);
+    uint64_t start = virt;
+    uint64_t left = pages;
+    bool stale = false;
+    uint64_t leaf = leaf_flags(virt, flags);
+
+    while (left) {
+        uint64_t* pml3 = get_or_alloc_table(
+            pagemap, page_index(virt, PML4_SHIFT), flags, PML4_SHIFT);
+        uint64_t* pml2 = get_or_alloc_table(
+            pml3, page_index(virt, PML3_SHIFT), flags, PML3_SHIFT);
+        uint64_t* pml1 = get_or_alloc_table(
+            pml2, page_index(virt, PML2_SHIFT), flags, PML2_SHIFT);
+        if (!pml1) {
+            break;
+        }
 
-    uint64_t* pml3 = get_or_alloc_table(pagemap, pml4_idx, flags);
-    if (!pml3) {
-        return -1;
+        uint64_t idx = page_index(virt, PML1_SHIFT);
+        for (; idx <= PAGE_INDEX_MASK && left; idx++, left--) {
+            stale |= pml1[idx] & VMM_PRESENT;
+            if (!pml1[idx]) {
+                table_get(pml1);
+            }
+            pml1[idx] = phys | leaf;
+            virt += PAGE_SIZE;
+            phys += PAGE_SIZE;
+        }
     }
 
-    uint64_t* pml2 = get_or_alloc_table(pml3, pml3_idx, flags);
-    if (!pml2) {
-        return -1;
+    if (stale) {
+        tlb_flush(pagemap, start, pages - left);
+    }
+    return left ? -1 : 0;
+}
+
+/*
+ * Helper: Unlink the lower half tables on virt's path that were left empty,
+ * bottom up. They go on *dead, chained through their first entry, to be
+ * freed once no TLB can walk them anymore. A page aligned pointer has the
+ * present bit clear, so a walk through one still sees an empty table.
+ */
+static void prune(uint64_t* pagemap, uint64_t virt, uint64_t** dead) {
+    if (virt >= VPM_USER_END) {
+        return;
     }
 
-    uint64_t* pml1 = get_or_alloc_table(pml2, pml2_idx, flags);
-    if (!pml1) {
-        return -1;
+    static const uint64_t shifts[] = {PML4_SHIFT, PML3_SHIFT, PML2_SHIFT};
+    uint64_t* path[4] = {pagemap};
+    for (int level = 1; level < 4; level++) {
+        path[level] = get_table(path[level - 1],
+                                page_index(virt, shifts[level - 1]));
     }
 
-    pml1[pml1_idx] = phys | flags;
-    __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
-    return 0;
+    for (int level = 3; level > 0; level--) {
+        uint64_t* table = path[level];
+        if (!table) {
+            continue;
+        }
+        if (!table_empty(table)) {
+            return;
+        }
+
+        path[level - 1][page_index(virt, shifts[level - 1])] = 0;
+        table_put(path[level - 1]);
+        table[0] = (uint64_t)*dead;
+        *dead = table;
+    }
 }
 
-/* Unmap virtual address */
-int vunmap(uint64_t* pagemap, uint64_t virt) {
+/*
+ * Unmap pages contiguous pages, skipping over tables that aren't there. A 2M
+ * page is dropped whole if the range covers it, or split first if not.
+ * Tables left empty are freed.
+ */
+int vunmap_range(uint64_t* pagemap, uint64_t virt, uint64_t pages) {
     if (!pagemap || (virt & (PAGE_SIZE - 1))) {
         return -1;
     }
 
-    uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
-    uint64_t* pml3 = get_table(pagemap, pml4_idx);
-    if (!pml3) {
-        return 0;
+    uint64_t start = virt;
+    bool stale = false;
+    uint64_t* dead = NULL;
+    int ret = 0;
+
+    for (uint64_t left = pages; left;) {
+        uint64_t* pml3 = get_table(pagemap, page_index(virt, PML4_SHIFT));
+        uint64_t* pml2 = get_table(pml3, page_index(virt, PML3_SHIFT));
+        uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
+
+        uint64_t idx = page_index(virt, PML1_SHIFT);
+        uint64_t count = PAGE_INDEX_MASK + 1 - idx;
+        if (count > left) {
+            count = left;
+        }
+
+        if (pml2 && (pml2[pml2_idx] & VMM_PRESENT) &&
+            (pml2[pml2_idx] & VMM_LARGE)) {
+            if (count == PAGE_INDEX_MASK + 1) {
+                pml2[pml2_idx] = 0;
+                table_put(pml2);
+                prune(pagemap, virt, &dead);
+                stale = true;
+                virt += count * PAGE_SIZE;
+                left -= count;
+                continue;
+            }
+            if (!split_large(pml2, pml2_idx, PML2_SHIFT)) {
+                ret = -1;
+                break;
+            }
+        }
+
+        uint64_t* pml1 = get_table(pml2, pml2_idx);
+        for (uint64_t i = 0; pml1 && i < count; i++) {
+            if (pml1[idx + i]) {
+                stale |= pml1[idx + i] & VMM_PRESENT;
+                pml1[idx + i] = 0;
+                table_put(pml1);
+            }
+        }
+        if (pml1) {
+            prune(pagemap, virt, &dead);
+        }
+        virt += count * PAGE_SIZE;
+        left -= count;
     }
 
-    uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
-    uint64_t* pml2 = get_table(pml3, pml3_idx);
-    if (!pml2) {
-        return 0;
+    if (stale || dead) {
+        tlb_flush(pagemap, start, pages);
+    }
+    while (dead) {
+        uint64_t* next = (uint64_t*)dead[0];
+        dead[0] = 0;
+        table_put(dead);
+        dead = next;
     }
+    return ret;
+}
+
+/* Map virtual to physical address */
+int vmap(uint64_t* pagemap, uint64_t virt, uint64_t phys, uint64_t flags) {
+    return vmap_range(pagemap, virt, phys, 1, flags);
+}
+
+/* Unmap virtual address */
+int vunmap(uint64_t* pagemap, uint64_t virt) {
+    return vunmap_range(pagemap, virt, 1);
+}
 
+#if LARGE_PAGES
+static void detect_large_pages(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    has_large_2m = edx & (1 << 3); // PSE
+
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (has_large_2m && eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        has_large_1g = edx & (1 << 26); // Page1GB
+    }
+}
+#else  // LARGE_PAGES
+static void detect_large_pages(void) {
+    log_early("warning: Large pages are disabled in the kernel");
+}
+#endif // LARGE_PAGES
+
+bool _supports_large_pages() { return has_large_2m; }
+
+/* Map virtual to physical address (large 2M pages) */
+int vmap_large(uint64_t* pagemap, uint64_t virt, uint64_t phys,
+               uint64_t flags) {
+    if (!pagemap || (virt & (PAGE_SIZE_2M - 1)) || (phys & (PAGE_SIZE_2M - 1)))
+        return -1;
+
+    if (!has_large_2m) {
+        log_early(
+            "error: vmap_large() is unsupported: 2MB pages not supported!");
+        return -1;
+    }
+
+    uint64_t pml4_idx = page_index(virt, PML4_SHIFT);
+    uint64_t pml3_idx = page_index(virt, PML3_SHIFT);
     uint64_t pml2_idx = page_index(virt, PML2_SHIFT);
-    uint64_t* pml1 = get_table(pml2, pml2_idx);
-    if (!pml1) {
+
+    uint64_t* pml3 = get_or_alloc_table(pagemap, pml4_idx, flags, PML4_SHIFT);
+    if (!pml3)
+        return -1;
+
+    uint64_t* pml2 = get_or_alloc_table(pml3, pml3_idx, flags, PML3_SHIFT);
+    if (!pml2)
+        return -1;
+
+    /* Whatever table was here is dropped, and freed once it's flushed */
+    uint64_t old = pml2[pml2_idx];
+    pml2[pml2_idx] = phys | leaf_flags(virt, flags) | VMM_LARGE;
+    if (!old)
+        table_get(pml2);
+    if (!(old & VMM_PRESENT))
         return 0;
-    }
 
-    uint64_t pml1_idx = page_index(virt, PML1_SHIFT);
-    pml1[pml1_idx] = 0;
-    __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
+    /* Other PCIDs may have cached the dropped table, invlpg misses those */
+    bool table = !(old & VMM_LARGE);
+    if (table && virt >= VPM_USER_END)
+        pcid_forget(NULL);
+    tlb_flush(pagemap, virt, PAGE_SIZE_2M / PAGE_SIZE);
+    if (table)
+        table_destroy((uint64_t*)HIGHER_HALF(old & PAGE_MASK), 1);
     return 0;
 }
 
+/*
+ * Map physical [phys, end) into the HHDM with the largest pages that fit.
+ * Anything mapped there already is left alone.
+ */
+static void map_direct(uint64_t phys, uint64_t end, uint64_t flags) {
+    uint64_t leaf = leaf_flags((uint64_t)HIGHER_HALF(phys), flags);
+
+    while (phys < end) {
+        uint64_t virt = (uint64_t)HIGHER_HALF(phys);
+        uint64_t left = end - phys;
+
+        uint64_t* pml3 = get_or_alloc_table(
+            kernel_pagemap, page_index(virt, PML4_SHIFT), flags, PML4_SHIFT);
+        uint64_t* pml3e = &pml3[page_index(virt, PML3_SHIFT)];
+        if (has_large_1g && !(*pml3e & VMM_PRESENT) &&
+            !(phys & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G) {
+            *pml3e = phys | leaf | VMM_LARGE;
+            table_get(pml3);
+        }
+        if (*pml3e & VMM_LARGE) {
+            phys = ALIGN_DOWN(phys, PAGE_SIZE_1G) + PAGE_SIZE_1G;
+            continue;
+        }
+
+        uint64_t* pml2 = get_or_alloc_table(
+            pml3, page_index(virt, PML3_SHIFT), flags, PML3_SHIFT);
+        uint64_t* pml2e = &pml2[page_index(virt, PML2_SHIFT)];
+        if (has_large_2m && !(*pml2e & VMM_PRESENT) &&
+            !(phys & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M) {
+            *pml2e = phys | leaf | VMM_LARGE;
+            table_get(pml2);
+        }
+        if (*pml2e & VMM_LARGE) {
+            phys = ALIGN_DOWN(phys, PAGE_SIZE_2M) + PAGE_SIZE_2M;
+            continue;
+        }
+
+        uint64_t* pml1 = get_or_alloc_table(
+            pml2, page_index(virt, PML2_SHIFT), flags, PML2_SHIFT);
+        uint64_t* pml1e = &pml1[page_index(virt, PML1_SHIFT)];
+        if (!(*pml1e & VMM_PRESENT)) {
+            *pml1e = phys | leaf;
+            table_get(pml1);
+        }
+        phys += PAGE_SIZE;
+    }
+}
+
 /* Initialize kernel paging */
 void paging_init(void) {
-    kernel_pagemap = palloc(1, true);
+    kernel_pagemap = table_alloc();
     if (!kernel_pagemap || !IS_PAGE_ALIGNED((uint64_t)kernel_pagemap)) {
         kpanic(NULL, "Failed to allocate kernel pagemap");
     }
-    memset(kernel_pagemap, 0, PAGE_SIZE);
 
-    if (_supports_large_pages())
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    has_pcid = ecx & (1 << 17);
+    if (has_pcid)
+        log_early("Support for PCIDs is present");
+    has_pge = edx & (1 << 13);
+
+    idt_register_handler(TLB_SHOOTDOWN_VECTOR, tlb_shootdown_handler);
+
+    detect_large_pages();
+    if (has_large_1g)
+        log_early("Support for 1GB and 2MB pages is present");
+    else if (has_large_2m)
         log_early("Support for 2MB pages is present");
 
+    /*
+     * Every PML4 entry of the upper half gets its PML3 now and keeps it, so
+     * pagemaps made by pmnew() see all later kernel mappings without having
+     * them copied in.
+     */
+    for (uint64_t i = 256; i < 512; i++) {
+        uint64_t* pml3 = table_alloc();
+        if (!pml3) {
+            kpanic(NULL, "Failed to allocate kernel PML3 %llu", i);
+        }
+        kernel_pagemap[i] = (uint64_t)PHYSICAL(pml3) | VMM_PRESENT | VMM_WRITE;
+    }
+
     /* Map kernel stack */
     uint64_t stack_top = ALIGN_UP(kstack_top, PAGE_SIZE);
-    for (uint64_t addr = stack_top - (16 * 1024); addr < stack_top;
-         addr += PAGE_SIZE) {
-        uint64_t phys = (uint64_t)PHYSICAL(addr);
-        vmap(kernel_pagemap, addr, phys, VMM_PRESENT | VMM_WRITE | VMM_NX);
-    }
+    uint64_t stack_bottom = stack_top - (16 * 1024);
+    vmap_range(kernel_pagemap, stack_bottom, (uint64_t)PHYSICAL(stack_bottom),
+               (16 * 1024) / PAGE_SIZE, VMM_PRESENT | VMM_WRITE | VMM_NX);
 
     /* Map bootloader requests */
     uint64_t breq_start = ALIGN_DOWN(__limine_requests_start, PAGE_SIZE);
     uint64_t breq_end = ALIGN_UP(__limine_requests_end, PAGE_SIZE);
     PRINT_SECTION("limine", breq_start, breq_end);
-    for (uint64_t reqs = breq_start; reqs < breq_end; reqs += PAGE_SIZE) {
-        vmap(kernel_pagemap, reqs, reqs - kvirt + kphys,
-             VMM_PRESENT | VMM_WRITE);
-    }
+    vmap_range(kernel_pagemap, breq_start, breq_start - kvirt + kphys,
+               (breq_end - breq_start) / PAGE_SIZE, VMM_PRESENT | VMM_WRITE);
 
     /* Map kernel sections */
     uint64_t text_start = ALIGN_DOWN((uint64_t)__text_start, PAGE_SIZE);
     uint64_t text_end = ALIGN_UP((uint64_t)__text_end, PAGE_SIZE);
     PRINT_SECTION(".text", text_start, text_end);
-    for (uint64_t addr = text_start; addr < text_end; addr += PAGE_SIZE) {
-        uint64_t phys = addr - kvirt + kphys;
-        vmap(kernel_pagemap, addr, phys, VMM_PRESENT);
-    }
+    vmap_range(kernel_pagemap, text_start, text_start - kvirt + kphys,
+               (text_end - text_start) / PAGE_SIZE, VMM_PRESENT);
 
     uint64_t rodata_start = ALIGN_DOWN((uint64_t)__rodata_start, PAGE_SIZE);
     uint64_t rodata_end = ALIGN_UP((uint64_t)__rodata_end, PAGE_SIZE);
     PRINT_SECTION(".rodata", rodata_start, rodata_end);
-    for (uint64_t addr = rodata_start; addr < rodata_end; addr += PAGE_SIZE) {
-        uint64_t phys = addr - kvirt + kphys;
-        vmap(kernel_pagemap, addr, phys, VMM_PRESENT | VMM_NX);
-    }
+    vmap_range(kernel_pagemap, rodata_start, rodata_start - kvirt + kphys,
+               (rodata_end - rodata_start) / PAGE_SIZE, VMM_PRESENT | VMM_NX);
 
     uint64_t data_start = ALIGN_DOWN((uint64_t)__data_start, PAGE_SIZE);
     uint64_t data_end = ALIGN_UP((uint64_t)__data_end, PAGE_SIZE);
     PRINT_SECTION(".data", data_start, data_end);
-    for (uint64_t addr = data_start; addr < data_end; addr += PAGE_SIZE) {
-        uint64_t phys = addr - kvirt + kphys;
-        vmap(kernel_pagemap, addr, phys, VMM_PRESENT | VMM_WRITE | VMM_NX);
-    }
-
-    /* Map HHDM */
-    for (uint64_t gb4 = 0; gb4 < 0x100000000; gb4 += PAGE_SIZE) {
-        vmap(kernel_pagemap, (uint64_t)HIGHER_HALF(gb4), gb4,
-             VMM_PRESENT | VMM_WRITE);
-    }
-
-    /* Map physical memory with large pages when possible */
+    vmap_range(kernel_pagemap, data_start, data_start - kvirt + kphys,
+               (data_end - data_start) / PAGE_SIZE,
+               VMM_PRESENT | VMM_WRITE | VMM_NX);
+
+    /*
+     * Map the HHDM: the first 4 GiB whatever is there, then all the memory
+     * above that. Large pages keep the tables small and the TLB happy.
+     */
+    map_direct(0, 0x100000000, VMM_PRESENT | VMM_WRITE);
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        if (!memmap->entries[i]->base || !memmap->entries[i]->length) {
+        struct limine_memmap_entry* e = memmap->entries[i];
+        if (!e->length) {
             continue;
         }
 
-        uint64_t base = ALIGN_DOWN(memmap->entries[i]->base, PAGE_SIZE);
-        uint64_t end = ALIGN_UP(
-            memmap->entries[i]->base + memmap->entries[i]->length, PAGE_SIZE);
-
-        for (uint64_t addr = base; addr < end;) {
-            uint64_t virt = (uint64_t)HIGHER_HALF(addr);
-
-            // Try to map a 2MB page if both physical and virtual addresses are
-            // aligned
-            if (((addr & (PAGE_SIZE_2M - 1)) == 0) &&
-                ((virt & (PAGE_SIZE_2M - 1)) == 0) &&
-                (end - addr) >= PAGE_SIZE_2M) {
-                if (vmap_large(kernel_pagemap, virt, addr,
-                               VMM_PRESENT | VMM_WRITE | VMM_NX) == 0) {
-                    addr += PAGE_SIZE_2M;
-                    continue;
-                }
-            }
-
-            // Fallback to normal 4KB page
-            vmap(kernel_pagemap, virt, addr, VMM_PRESENT | VMM_WRITE | VMM_NX);
-            addr += PAGE_SIZE;
-        }
+        map_direct(ALIGN_DOWN(e->base, PAGE_SIZE),
+                   ALIGN_UP(e->base + e->length, PAGE_SIZE),
+                   VMM_PRESENT | VMM_WRITE | VMM_NX);
     }
 
     pmset(kernel_pagemap);
 }
+
+/* Per CPU setup: turn global pages and PCIDs on, load the kernel pagemap */
+void paging_cpu_init(void) {
+    pmset(kernel_pagemap);
+    if (has_pge) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+    if (has_pcid) {
+        write_cr4(read_cr4() | CR4_PCIDE); // Only allowed with PCID 0 loaded
+    }
+}
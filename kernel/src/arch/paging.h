@@ -15,9 +15,13 @@
 #define VMM_PRESENT (1ULL << 0)
 #define VMM_WRITE (1ULL << 1)
 #define VMM_USER (1ULL << 2)
+#define VMM_LARGE (1ULL << 7) // PS, in a PML3 or PML2 entry
+#define VMM_GLOBAL (1ULL << 8) // Kept across CR3 loads, set in the kernel half
+#define VMM_COW (1ULL << 9) // Available to software, shared until written
 #define VMM_NX (1ULL << 63)
 
 #define PAGE_MASK 0x000FFFFFFFFFF000ULL
+#define CR3_NOFLUSH (1ULL << 63) // Keep the TLB entries of the loaded PCID
 #define PAGE_INDEX_MASK 0x1FF
 
 #define PML1_SHIFT 12
@@ -30,10 +34,21 @@ extern uint64_t kstack_top;
 
 void pmset(uint64_t* pagemap);
 uint64_t* pmget(void);
+void vswitch(vctx_t* ctx);
 uint64_t* pmnew(void);
+void pmfree(uint64_t* pagemap);
+uint64_t pmtables(void);
 int vmap(uint64_t* pagemap, uint64_t virt, uint64_t phys, uint64_t flags);
 int vunmap(uint64_t* pagemap, uint64_t virt);
+int vmap_range(uint64_t* pagemap, uint64_t virt, uint64_t phys,
+               uint64_t pages, uint64_t flags);
+int vunmap_range(uint64_t* pagemap, uint64_t virt, uint64_t pages);
+int vmap_large(uint64_t* pagemap, uint64_t virt, uint64_t phys,
+               uint64_t flags);
+bool _supports_large_pages();
+uint64_t* vpte(uint64_t* pagemap, uint64_t virt);
 uint64_t virt_to_phys(uint64_t* pagemap, uint64_t virt);
 void paging_init(void);
+void paging_cpu_init(void);
 
 #endif // PAGING_H
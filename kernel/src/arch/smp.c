@@ -55,6 +55,14 @@ void test(void) {
         syscall(SYS_kping, 0, 0, 0);
 }
 
+/* Scrub free pages for palloc() while there's work, halt otherwise */
+noreturn void cpu_idle(void) {
+    for (;;) {
+        if (!pmm_scrub())
+            __asm__ volatile("hlt");
+    }
+}
+
 static void init_cpu(cpu_local_t* cpu) {
     (void)cpu;
     // TODO: CPU-specific GDT with different TSS and such.
@@ -63,7 +71,7 @@ static void init_cpu(cpu_local_t* cpu) {
     // FIXME: Maybe not re-initialize the entire IDT but rather just reload it
     idt_init();
 
-    pmset(kernel_pagemap);
+    paging_cpu_init();
     lapic_enable();
     tss_init(kstack_top);
     sched_init();
@@ -91,7 +99,7 @@ void smp_entry(struct limine_mp_info* smp_info) {
     cpu->ready = true;
     atomic_fetch_add(&started_cpus, 1);
     __asm__ volatile("sti");
-    hlt();
+    cpu_idle();
 }
 
 void smp_early_init(void) {
@@ -114,6 +122,7 @@ void smp_early_init(void) {
         cpu_locals[i].lapic_id = info->lapic_id;
         cpu_locals[i].cpu_index = i;
         cpu_locals[i].ready = false;
+        cpu_locals[i].numa_node = numa_node_of_lapic(info->lapic_id);
     }
 }
 
@@ -2,17 +2,50 @@
 #ifndef SMP_H
 #define SMP_H
 
+#include <mm/pmm.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdnoreturn.h>
+#include <sys/spinlock.h>
 
 #define MAX_CPUS                                                               \
     64 // eh, should be enough. We could increase to 256 but i doubt anyone
        // would run emk on that...
 
+/* PCIDs handed out by vswitch(), slot i is PCID i + 1 */
+#define PCID_SLOTS 8
+
+typedef struct {
+    uint64_t ctx_id; // vctx_t using the slot, 0 if none
+    uint64_t* pagemap;
+    bool stale; // Its TLB entries are out of date, flush on the next switch
+} pcid_slot_t;
+
+/* Shootdowns queued per CPU before it falls back to a full flush */
+#define TLB_QUEUE_SIZE 16
+
+typedef struct {
+    uint64_t* pagemap; // NULL for the kernel half
+    uint64_t virt;
+    uint64_t pages;
+} tlb_request_t;
+
 typedef struct {
     uint32_t lapic_id;
     uint32_t cpu_index;
     bool ready;
+    uint32_t numa_node;
+    pmm_magazine_t pmm_mag;
+    pcid_slot_t pcids[PCID_SLOTS];
+    uint32_t pcid;      // Loaded PCID, 0 if it isn't one of ours
+    uint32_t pcid_next; // Slot to evict next
+    uint64_t* pagemap;  // Loaded pagemap, NULL before paging_cpu_init()
+    spinlock_t tlb_lock;
+    tlb_request_t tlb_queue[TLB_QUEUE_SIZE];
+    uint32_t tlb_queued;
+    bool tlb_overflow; // The queue ran over, flush everything
+    uint64_t tlb_sent; // Shootdown tickets handed out for this CPU
+    uint64_t tlb_done; // ...and the last one handled
 } cpu_local_t;
 
 extern uint32_t bootstrap_lapic_id;
@@ -21,6 +54,12 @@ extern uint32_t cpu_count;
 
 void smp_early_init(void);
 void smp_init(void);
+noreturn void cpu_idle(void);
 cpu_local_t* get_cpu_local(void);
 
+/* Like get_cpu_local(), but NULL until smp_early_init() has filled cpu_locals */
+static inline cpu_local_t* cpu_local_try(void) {
+    return cpu_count ? get_cpu_local() : NULL;
+}
+
 #endif // SMP_H
@@ -1,6 +1,14 @@
 /* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/idt.h>
 #include <arch/io.h>
+#include <arch/smp.h>
 #include <dev/serial.h>
+#include <sys/apic/ioapic.h>
+#include <sys/apic/lapic.h>
+
+#define COM1_VECTOR (32 + COM1_IRQ)
+
+static void (*rx_callback)(uint8_t c) = NULL;
 
 int serial_init(uint16_t port) {
     uint16_t base = (uint16_t)port;
@@ -72,4 +80,22 @@ int serial_read(uint16_t port, uint8_t* buffer, uint32_t length) {
         }
     }
     return i;
-}
\ No newline at end of file
+}
+
+static void serial_rx_handler(struct register_ctx* frame) {
+    uint8_t c;
+
+    (void)frame;
+    while (serial_read(COM1, &c, 1) == 1)
+        rx_callback(c);
+    lapic_eoi();
+}
+
+/* Pass every byte received on COM1 to `handler`, in interrupt context */
+void serial_rx_init(void (*handler)(uint8_t c)) {
+    rx_callback = handler;
+    idt_register_handler(COM1_VECTOR, serial_rx_handler);
+    ioapic_map(COM1_IRQ, COM1_VECTOR, 0, get_cpu_local()->lapic_id);
+    outb(COM1 + UART_IER, UART_IER_RX);
+    ioapic_unmask(COM1_IRQ);
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #define COM1 0x3f8
+#define COM1_IRQ 4
 
 // UART register offsets
 #define UART_DATA 0x00 // Data register (R/W)
@@ -16,6 +17,9 @@
 #define UART_MCR 0x04  // Modem Control Register (R/W)
 #define UART_LSR 0x05  // Line Status Register (R)
 
+// Interrupt Enable Register bits
+#define UART_IER_RX 0x01 // Received data available
+
 // Line Control Register bits
 #define UART_LCR_DLAB 0x80 // Divisor Latch Access Bit
 #define UART_LCR_8N1 0x03  // 8 bits, no parity, 1 stop bit
@@ -42,5 +46,6 @@
 int serial_init(uint16_t port);
 int serial_write(uint16_t port, const uint8_t* data, uint32_t length);
 int serial_read(uint16_t port, uint8_t* buffer, uint32_t length);
+void serial_rx_init(void (*handler)(uint8_t c));
 
 #endif // SERIAL_H
\ No newline at end of file
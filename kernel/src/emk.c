@@ -8,7 +8,9 @@
 #include <boot/limine.h>
 #include <dev/serial.h>
 #include <mm/heap.h>
+#include <mm/numa.h>
 #include <mm/pmm.h>
+#include <mm/slab.h>
 #include <mm/vmm.h>
 #include <sys/kpanic.h>
 #include <util/kprintf.h>
@@ -134,6 +136,23 @@ void tick(struct register_ctx* ctx) { sched_tick(ctx); }
 
 /* ---------------------------------------------------*/
 
+/* Debug dumps over COM1, however busy the CPUs are: p(mm), s(lab), h(eap) */
+static void serial_key(uint8_t c) {
+    switch (c) {
+    case 'p':
+        pmm_dump();
+        break;
+    case 's':
+        slab_dump();
+        break;
+#if HEAP_PROFILE
+    case 'h':
+        heap_profile_dump();
+        break;
+#endif // HEAP_PROFILE
+    }
+}
+
 void emk_entry(void) {
 
     __asm__ volatile("movq %%rsp, %0" : "=r"(kstack_top));
@@ -223,8 +242,12 @@ void emk_entry(void) {
     kphys = kernel_address_request.response->physical_base;
     paging_init();
 
-    /* Kernel Virtual Memory Context, not to be confused with KVM */
-    kvm_ctx = vinit(kernel_pagemap, 0x1000);
+    /*
+     * Kernel Virtual Memory Context, not to be confused with KVM. It lives
+     * in the upper half so every pagemap sees it through the shared tables.
+     */
+    vmm_init();
+    kvm_ctx = vinit(kernel_pagemap, VPM_KERNEL_START);
     if (!kvm_ctx) {
         kpanic(NULL, "Failed to create kernel VMM context");
     }
@@ -237,6 +260,10 @@ void emk_entry(void) {
     *b = 32;
     vfree(kvm_ctx, b);
 
+#if VMM_BENCH
+    vbench();
+#endif // VMM_BENCH
+
     /* Setup kernel heap */
     heap_init();
     char* c = kmalloc(1);
@@ -254,6 +281,7 @@ void emk_entry(void) {
     }
     acpi_init();
     madt_init(); // Also init MADT, to prepare for APIC
+    numa_init(); // Split physical memory by node, from SRAT/SLIT if present
 
     /* Disable legacy PIC to prepare for APIC */
     outb(0x21, 0xFF);
@@ -282,6 +310,7 @@ void emk_entry(void) {
 #endif // DISABLE_TIMER
 
     /* Initialize each CPU */
+    sched_early_init();
     smp_init();
 
 #if !DISABLE_TIMER
@@ -289,6 +318,8 @@ void emk_entry(void) {
         ioapic_unmask(0);
 #endif // not DISABLE_TIMER
 
+    serial_rx_init(serial_key);
+
     /* Handle init module */
     if (!cmdline_request.response || !mod_request.response) {
         log("error: Limine cmdline or module response is missing");
@@ -305,6 +336,7 @@ void emk_entry(void) {
             "defaulting to 0");
     } else {
         mod_idx = atoi(init);
+        kfree(init);
     }
 
     if (mod_idx >= mod_count) {
@@ -343,5 +375,5 @@ void emk_entry(void) {
 
     /* Finished, just enable interrupts and go on with our day... */
     __asm__ volatile("sti");
-    hlt();
+    cpu_idle();
 }
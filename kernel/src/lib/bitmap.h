@@ -2,6 +2,7 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 static inline void bitmap_set(uint8_t* bitmap, uint64_t bit) {
@@ -16,4 +17,36 @@ static inline uint8_t bitmap_get(uint8_t* bitmap, uint64_t bit) {
     return (bitmap[bit / 8] & (1 << (bit % 8))) != 0;
 }
 
-#endif // BITMAP_H
\ No newline at end of file
+/*
+ * Word at a time scans, the bitmap must be 8-byte aligned. Bit n of the byte
+ * layout above is bit n % 64 of word n / 64 on little endian.
+ */
+static inline uint64_t bitmap_scan(const uint8_t* bitmap, uint64_t start,
+                                   uint64_t end, bool set) {
+    const uint64_t* words = (const uint64_t*)bitmap;
+    uint64_t flip = set ? 0 : UINT64_MAX;
+
+    for (uint64_t i = start; i < end; i = (i & ~63ULL) + 64) {
+        uint64_t word = (words[i / 64] ^ flip) & (UINT64_MAX << (i % 64));
+        if (word) {
+            uint64_t bit = (i & ~63ULL) + __builtin_ctzll(word);
+            return bit < end ? bit : end;
+        }
+    }
+
+    return end;
+}
+
+/* First set bit in [start, end), or end if there is none */
+static inline uint64_t bitmap_next_set(const uint8_t* bitmap, uint64_t start,
+                                       uint64_t end) {
+    return bitmap_scan(bitmap, start, end, true);
+}
+
+/* First clear bit in [start, end), or end if there is none */
+static inline uint64_t bitmap_next_clear(const uint8_t* bitmap,
+                                         uint64_t start, uint64_t end) {
+    return bitmap_scan(bitmap, start, end, false);
+}
+
+#endif // BITMAP_H
@@ -0,0 +1,257 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <lib/rbtree.h>
+
+static inline bool is_red(rb_node_t* node) { return node && node->red; }
+
+static inline void augment(rb_tree_t* tree, rb_node_t* node) {
+    if (tree->augment)
+        tree->augment(node);
+}
+
+/* Point whatever pointed at old (its parent or the root) at new */
+static void replace_child(rb_tree_t* tree, rb_node_t* old, rb_node_t* new) {
+    rb_node_t* parent = old->parent;
+    if (!parent)
+        tree->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+/* Rotations only change the subtrees of the two nodes involved */
+static void rotate_left(rb_tree_t* tree, rb_node_t* x) {
+    rb_node_t* y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    replace_child(tree, x, y);
+    y->left = x;
+    x->parent = y;
+
+    augment(tree, x);
+    augment(tree, y);
+}
+
+static void rotate_right(rb_tree_t* tree, rb_node_t* x) {
+    rb_node_t* y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    replace_child(tree, x, y);
+    y->right = x;
+    x->parent = y;
+
+    augment(tree, x);
+    augment(tree, y);
+}
+
+void rb_propagate(rb_tree_t* tree, rb_node_t* node) {
+    if (!tree->augment)
+        return;
+
+    for (; node; node = node->parent)
+        tree->augment(node);
+}
+
+void rb_insert(rb_tree_t* tree, rb_node_t* node, rb_node_t* parent,
+               rb_node_t** link) {
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    *link = node;
+    rb_propagate(tree, node);
+
+    while (is_red(node->parent)) {
+        rb_node_t* p = node->parent;
+        rb_node_t* g = p->parent; // Exists, the root is never red here
+
+        if (p == g->left) {
+            rb_node_t* uncle = g->right;
+            if (is_red(uncle)) {
+                p->red = uncle->red = false;
+                g->red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->right) {
+                rotate_left(tree, p);
+                node = p;
+                p = node->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rotate_right(tree, g);
+        } else {
+            rb_node_t* uncle = g->left;
+            if (is_red(uncle)) {
+                p->red = uncle->red = false;
+                g->red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->left) {
+                rotate_right(tree, p);
+                node = p;
+                p = node->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rotate_left(tree, g);
+        }
+    }
+
+    tree->root->red = false;
+}
+
+/* Restore the black height after removing a black node above x */
+static void erase_fixup(rb_tree_t* tree, rb_node_t* x, rb_node_t* parent) {
+    while (x != tree->root && !is_red(x)) {
+        if (x == parent->left) {
+            rb_node_t* w = parent->right;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->right)) {
+                w->left->red = false;
+                w->red = true;
+                rotate_right(tree, w);
+                w = parent->right;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->right->red = false;
+            rotate_left(tree, parent);
+        } else {
+            rb_node_t* w = parent->left;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->left)) {
+                w->right->red = false;
+                w->red = true;
+                rotate_left(tree, w);
+                w = parent->left;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->left->red = false;
+            rotate_right(tree, parent);
+        }
+        x = tree->root;
+    }
+
+    if (x)
+        x->red = false;
+}
+
+void rb_erase(rb_tree_t* tree, rb_node_t* node) {
+    rb_node_t* child;
+    rb_node_t* parent;
+    bool red;
+
+    if (!node->left || !node->right) {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        red = node->red;
+        replace_child(tree, node, child);
+        if (child)
+            child->parent = parent;
+    } else {
+        /* Two children, the in-order successor takes node's place */
+        rb_node_t* succ = node->right;
+        while (succ->left)
+            succ = succ->left;
+
+        child = succ->right;
+        red = succ->red;
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            parent->left = child;
+            if (child)
+                child->parent = parent;
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        replace_child(tree, node, succ);
+        succ->parent = node->parent;
+        succ->red = node->red;
+    }
+
+    rb_propagate(tree, parent);
+    if (!red)
+        erase_fixup(tree, child, parent);
+}
+
+rb_node_t* rb_first(rb_tree_t* tree) {
+    rb_node_t* node = tree->root;
+    if (!node)
+        return NULL;
+
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+rb_node_t* rb_last(rb_tree_t* tree) {
+    rb_node_t* node = tree->root;
+    if (!node)
+        return NULL;
+
+    while (node->right)
+        node = node->right;
+    return node;
+}
+
+rb_node_t* rb_next(rb_node_t* node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
+
+rb_node_t* rb_prev(rb_node_t* node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return node;
+    }
+
+    while (node->parent && node == node->parent->left)
+        node = node->parent;
+    return node->parent;
+}
@@ -0,0 +1,43 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef RBTREE_H
+#define RBTREE_H
+
+/*
+ * Intrusive red-black tree. Callers walk down from tree->root themselves to
+ * find where a node goes and pass the link to rb_insert(), so ordering is
+ * entirely up to them. An optional augment callback keeps a per node summary
+ * of its subtree (e.g. the largest gap below it) up to date: it is called on
+ * every node whose subtree changed, children before parents.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    bool red;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t* root;
+    void (*augment)(rb_node_t* node); // May be NULL
+} rb_tree_t;
+
+#define rb_entry(ptr, type, member)                                            \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+void rb_insert(rb_tree_t* tree, rb_node_t* node, rb_node_t* parent,
+               rb_node_t** link);
+void rb_erase(rb_tree_t* tree, rb_node_t* node);
+
+/* Re-run augment from node up to the root, after changing its own value */
+void rb_propagate(rb_tree_t* tree, rb_node_t* node);
+
+rb_node_t* rb_first(rb_tree_t* tree);
+rb_node_t* rb_last(rb_tree_t* tree);
+rb_node_t* rb_next(rb_node_t* node);
+rb_node_t* rb_prev(rb_node_t* node);
+
+#endif // RBTREE_H
@@ -0,0 +1,25 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <lib/string.h>
+#include <mm/heap.h>
+#include <stdint.h>
+
+/* Backend independent heap helpers, the backends live in mm/heap/ */
+
+void* kcalloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total))
+        return NULL;
+
+    void* ptr = kmalloc(total);
+    if (!ptr)
+        return NULL;
+
+    memset(ptr, 0, total);
+
+#if HEAP_PROFILE
+    /* Charge the allocation to our caller rather than to kcalloc itself */
+    heap_profile_free(ptr);
+    heap_profile_alloc(ptr, total, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return ptr;
+}
@@ -6,6 +6,19 @@
 
 void heap_init();
 void* kmalloc(size_t size);
+void* kmalloc_aligned(size_t size, size_t align); // align is a power of two
+void* kcalloc(size_t count, size_t size);
+void* krealloc(void* ptr, size_t size);
 void kfree(void* ptr);
 
+/* Calls fn with the size of every free chunk, implemented by the backend */
+void heap_walk_free(void (*fn)(size_t size));
+
+/* Call site profiling, see mm/heap/profile.c */
+#if HEAP_PROFILE
+void heap_profile_alloc(void* ptr, size_t size, void* site);
+void heap_profile_free(void* ptr);
+void heap_profile_dump(void);
+#endif // HEAP_PROFILE
+
 #endif // HEAP_H
\ No newline at end of file
@@ -0,0 +1,424 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
+#include <boot/emk.h>
+#include <lib/string.h>
+#include <mm/heap.h>
+#include <mm/heap/bt.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <stdbool.h>
+#include <sys/kpanic.h>
+#include <sys/spinlock.h>
+#include <util/align.h>
+#include <util/log.h>
+
+/*
+ * Arenas are valloc'd runs laid out as
+ *
+ *   [bt_arena_t][used footer][blocks ...][used header]
+ *
+ * so the first and last block always see a used neighbour and merges never
+ * leave the arena. Free blocks sit on one list per power of two size class,
+ * with a bitmask of non-empty classes to find a bigger one in O(1).
+ */
+#define ARENA_OVERHEAD (sizeof(bt_arena_t) + 2 * sizeof(bt_tag_t))
+
+static bt_arena_t* arenas = NULL;
+static bt_free_t* bins[BT_BINS];
+static uint64_t nonempty;
+static spinlock_t heap_lock;
+static spinlock_t map_lock; // kvm_ctx has no lock, grow and reclaim share this
+
+static inline size_t block_size(uint8_t* block) {
+    return *(bt_tag_t*)block & ~(bt_tag_t)0xF;
+}
+
+static inline bool block_used(uint8_t* block) {
+    return *(bt_tag_t*)block & BT_TAG_USED;
+}
+
+static inline void set_tags(uint8_t* block, size_t size, bool used) {
+    bt_tag_t tag = size | (used ? BT_TAG_USED : 0);
+    *(bt_tag_t*)block = tag;
+    *(bt_tag_t*)(block + size - sizeof(bt_tag_t)) = tag;
+}
+
+static inline bt_free_t* links_of(uint8_t* block) {
+    return (bt_free_t*)(block + sizeof(bt_tag_t));
+}
+
+static inline uint8_t* block_of(bt_free_t* links) {
+    return (uint8_t*)links - sizeof(bt_tag_t);
+}
+
+static inline uint8_t* arena_first(bt_arena_t* arena) {
+    return (uint8_t*)(arena + 1) + sizeof(bt_tag_t);
+}
+
+static inline uint32_t bin_of(size_t size) {
+    return 63 - __builtin_clzll(size);
+}
+
+static void bin_insert(uint8_t* block) {
+    uint32_t bin = bin_of(block_size(block));
+    bt_free_t* links = links_of(block);
+
+    links->prev = NULL;
+    links->next = bins[bin];
+    if (bins[bin])
+        bins[bin]->prev = links;
+    bins[bin] = links;
+    nonempty |= 1ULL << bin;
+}
+
+static void bin_remove(uint8_t* block) {
+    uint32_t bin = bin_of(block_size(block));
+    bt_free_t* links = links_of(block);
+
+    if (links->prev)
+        links->prev->next = links->next;
+    else
+        bins[bin] = links->next;
+    if (links->next)
+        links->next->prev = links->prev;
+    if (!bins[bin])
+        nonempty &= ~(1ULL << bin);
+}
+
+/*
+ * Good fit: the best of the first few blocks in the request's own class,
+ * else the head of the next non-empty class, where anything fits.
+ */
+static uint8_t* find_fit(size_t need) {
+    uint32_t bin = bin_of(need);
+    uint8_t* best = NULL;
+    uint32_t scanned = 0;
+
+    for (bt_free_t* f = bins[bin]; f && scanned < BT_FIT_SCAN;
+         f = f->next, scanned++) {
+        size_t size = block_size(block_of(f));
+        if (size >= need && (!best || size < block_size(best))) {
+            best = block_of(f);
+            if (size == need)
+                break;
+        }
+    }
+    if (best)
+        return best;
+
+    uint64_t larger = nonempty & ~((2ULL << bin) - 1);
+    if (!larger)
+        return NULL;
+    return block_of(bins[__builtin_ctzll(larger)]);
+}
+
+/* Map a new arena with a block of at least `need` bytes, heap_lock held */
+static bool heap_grow(size_t need) {
+    size_t pages = DIV_ROUND_UP(need + ARENA_OVERHEAD, PAGE_SIZE);
+    if (pages < BT_ARENA_SIZE)
+        pages = BT_ARENA_SIZE;
+
+    spinlock_acquire(&map_lock);
+    bt_arena_t* arena = valloc(kvm_ctx, pages, VALLOC_RW);
+    spinlock_release(&map_lock);
+    if (!arena)
+        return false;
+
+    arena->pages = pages;
+    arena->next = arenas;
+    arenas = arena;
+
+    uint8_t* first = arena_first(arena);
+    *(bt_tag_t*)(first - sizeof(bt_tag_t)) = BT_TAG_USED;
+    *(bt_tag_t*)((uint8_t*)arena + pages * PAGE_SIZE - sizeof(bt_tag_t)) =
+        BT_TAG_USED;
+    set_tags(first, pages * PAGE_SIZE - ARENA_OVERHEAD, false);
+    bin_insert(first);
+    return true;
+}
+
+/* PMM reclaimer, unmaps every fully free arena but the first, see ff.c */
+static uint64_t heap_reclaim(void) {
+    bt_arena_t* release = NULL;
+    uint64_t pages = 0;
+
+    uint64_t flags = irq_save();
+    if (!spinlock_try_acquire(&map_lock)) {
+        irq_restore(flags);
+        return 0;
+    }
+    if (!spinlock_try_acquire(&heap_lock)) {
+        spinlock_release(&map_lock);
+        irq_restore(flags);
+        return 0;
+    }
+
+    bt_arena_t** link = &arenas;
+    while (*link) {
+        bt_arena_t* arena = *link;
+        uint8_t* first = arena_first(arena);
+
+        if (arena->next == NULL || block_used(first) ||
+            block_size(first) != arena->pages * PAGE_SIZE - ARENA_OVERHEAD) {
+            link = &arena->next;
+            continue;
+        }
+
+        bin_remove(first);
+        *link = arena->next;
+        arena->next = release;
+        release = arena;
+        pages += arena->pages;
+    }
+
+    spinlock_release(&heap_lock);
+
+    while (release) {
+        bt_arena_t* next = release->next;
+        vfree(kvm_ctx, release);
+        release = next;
+    }
+
+    spinlock_release(&map_lock);
+    irq_restore(flags);
+    return pages;
+}
+
+void heap_init() {
+    spinlock_init(&heap_lock);
+    spinlock_init(&map_lock);
+    if (!heap_grow(0))
+        kpanic(NULL, "Failed to alloc memory for the heap pool");
+    pmm_add_reclaimer(heap_reclaim);
+    log_early("Initialized boundary-tag heap with a pool of %d pages (~%dMB)",
+              BT_ARENA_SIZE,
+              DIV_ROUND_UP(BT_ARENA_SIZE * PAGE_SIZE, 1024 * 1024));
+}
+
+static inline size_t block_need(size_t size) {
+    size_t need = ALIGN_UP(size + 2 * sizeof(bt_tag_t), 16);
+    return need < BT_MIN_BLOCK ? BT_MIN_BLOCK : need;
+}
+
+/* Cut a used block down to `need`, freeing the tail if big enough */
+static void bt_trim(uint8_t* block, size_t need) {
+    size_t avail = block_size(block);
+    if (avail - need < BT_MIN_BLOCK)
+        return;
+
+    set_tags(block, need, true);
+
+    uint8_t* tail = block + need;
+    size_t tail_size = avail - need;
+    uint8_t* next = tail + tail_size;
+    if (!block_used(next)) {
+        bin_remove(next);
+        tail_size += block_size(next);
+    }
+
+    set_tags(tail, tail_size, false);
+    bin_insert(tail);
+}
+
+/* Take a used block of at least `need` bytes, heap_lock held */
+static uint8_t* bt_take(size_t need) {
+    uint8_t* block = find_fit(need);
+    if (!block && heap_grow(need))
+        block = find_fit(need);
+    if (!block)
+        return NULL;
+
+    bin_remove(block);
+    set_tags(block, block_size(block), true);
+    bt_trim(block, need);
+    return block;
+}
+
+static void* bt_malloc(size_t size) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    uint8_t* block = bt_take(block_need(size));
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+    return block ? block + sizeof(bt_tag_t) : NULL;
+}
+
+static void bt_free(void* ptr) {
+    uint8_t* block = (uint8_t*)ptr - sizeof(bt_tag_t);
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+
+    if (!block_used(block)) {
+        spinlock_release(&heap_lock);
+        irq_restore(flags);
+        log("warning: kfree: double free of %p", ptr);
+        return;
+    }
+
+    /* Merging backwards leaves this header inside prev, a second free of
+     * ptr has to find it free rather than a stale used tag */
+    size_t size = block_size(block);
+    *(bt_tag_t*)block = size;
+
+    uint8_t* next = block + size;
+    if (!block_used(next)) {
+        bin_remove(next);
+        size += block_size(next);
+    }
+
+    bt_tag_t prev_tag = *(bt_tag_t*)(block - sizeof(bt_tag_t));
+    if (!(prev_tag & BT_TAG_USED)) {
+        uint8_t* prev = block - (prev_tag & ~(bt_tag_t)0xF);
+        bin_remove(prev);
+        size += block_size(prev);
+        block = prev;
+    }
+
+    set_tags(block, size, false);
+    bin_insert(block);
+
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    void* ptr = bt_malloc(size);
+
+#if HEAP_PROFILE
+    if (ptr)
+        heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return ptr;
+}
+
+/*
+ * Payloads are always 16 byte aligned. For more, over-allocate and free
+ * the lead up to the first aligned payload as a block of its own, its
+ * previous neighbour is never free so no merge is needed.
+ */
+void* kmalloc_aligned(size_t size, size_t align) {
+    if (size == 0 || (align & (align - 1)))
+        return NULL;
+
+    if (align <= 16) {
+        void* ptr = bt_malloc(size);
+#if HEAP_PROFILE
+        if (ptr)
+            heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+        return ptr;
+    }
+
+    size_t need = block_need(size);
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+
+    uint8_t* block = bt_take(need + align + BT_MIN_BLOCK);
+    if (block) {
+        uint64_t payload = (uint64_t)block + sizeof(bt_tag_t);
+        uint64_t start = ALIGN_UP(payload, align);
+        while (start != payload && start - payload < BT_MIN_BLOCK)
+            start += align;
+
+        if (start != payload) {
+            size_t lead = start - payload;
+            size_t total = block_size(block);
+            set_tags(block, lead, false);
+            bin_insert(block);
+            block += lead;
+            set_tags(block, total - lead, true);
+        }
+        bt_trim(block, need);
+    }
+
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+
+    void* ptr = block ? block + sizeof(bt_tag_t) : NULL;
+#if HEAP_PROFILE
+    if (ptr)
+        heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return ptr;
+}
+
+/* Grows into the next block when it's free, copies only as a last resort */
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) {
+        ptr = size ? bt_malloc(size) : NULL;
+#if HEAP_PROFILE
+        if (ptr)
+            heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+        return ptr;
+    }
+
+#if HEAP_PROFILE
+    heap_profile_free(ptr);
+#endif // HEAP_PROFILE
+
+    if (size == 0) {
+        bt_free(ptr);
+        return NULL;
+    }
+
+    size_t need = block_need(size);
+    uint8_t* block = (uint8_t*)ptr - sizeof(bt_tag_t);
+    void* new = ptr;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+
+    size_t cur = block_size(block);
+    uint8_t* next = block + cur;
+    if (cur < need && !block_used(next) && cur + block_size(next) >= need) {
+        bin_remove(next);
+        cur += block_size(next);
+        set_tags(block, cur, true);
+    }
+    if (cur >= need)
+        bt_trim(block, need);
+
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+
+    if (cur < need) {
+        new = bt_malloc(size);
+        if (new) {
+            memcpy(new, ptr, cur - 2 * sizeof(bt_tag_t));
+            bt_free(ptr);
+        }
+    }
+
+#if HEAP_PROFILE
+    heap_profile_alloc(new ? new : ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return new;
+}
+
+void kfree(void* ptr) {
+    if (!ptr)
+        return;
+
+#if HEAP_PROFILE
+    heap_profile_free(ptr);
+#endif // HEAP_PROFILE
+
+    bt_free(ptr);
+}
+
+void heap_walk_free(void (*fn)(size_t size)) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    for (uint32_t bin = 0; bin < BT_BINS; bin++) {
+        for (bt_free_t* f = bins[bin]; f; f = f->next)
+            fn(block_size(block_of(f)) - 2 * sizeof(bt_tag_t));
+    }
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+}
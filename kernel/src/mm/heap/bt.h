@@ -0,0 +1,37 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef BT_H
+#define BT_H
+
+/* Boundary-tag heap with segregated free lists */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BT_ARENA_SIZE
+#define BT_ARENA_SIZE 512 // Initial pool and minimum growth, in pages
+#endif // BT_ARENA_SIZE
+
+#define BT_BINS 48      // One per power of two block size
+#define BT_FIT_SCAN 8   // Blocks looked at for a best fit in one bin
+#define BT_TAG_USED 1ULL
+#define BT_MIN_BLOCK 32 // Tag, two links and footer
+
+/*
+ * A block is a size|used tag, the payload and a copy of the tag as footer.
+ * Sizes cover all of it and are multiples of 16, blocks start 8 bytes past
+ * a 16 byte boundary so payloads are 16 byte aligned.
+ */
+typedef uint64_t bt_tag_t;
+
+/* Lives in the payload of free blocks */
+typedef struct bt_free {
+    struct bt_free* next;
+    struct bt_free* prev;
+} bt_free_t;
+
+typedef struct bt_arena {
+    size_t pages;
+    struct bt_arena* next;
+} bt_arena_t;
+
+#endif // BT_H
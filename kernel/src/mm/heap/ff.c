@@ -1,33 +1,157 @@
 /* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
 #include <boot/emk.h>
+#include <lib/string.h>
 #include <mm/heap.h>
 #include <mm/heap/ff.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <sys/kpanic.h>
+#include <sys/spinlock.h>
 #include <util/align.h>
 #include <util/log.h>
 
-void* pool;
+/*
+ * The heap is a list of arenas, each a valloc'd run of pages starting with
+ * an arena_t. The freelist spans all of them sorted by address, the arena
+ * headers keep blocks of neighbouring arenas from ever coalescing.
+ */
+arena_t* arenas = NULL;
 block_t* freelist = NULL;
+static spinlock_t heap_lock;
+static spinlock_t map_lock; // kvm_ctx has no lock, grow and reclaim share this
+
+static inline block_t* arena_block(arena_t* arena) {
+    return (block_t*)(arena + 1);
+}
+
+static inline size_t arena_capacity(arena_t* arena) {
+    return arena->pages * PAGE_SIZE - sizeof(arena_t) - sizeof(block_t);
+}
+
+/* Insert a free block sorted by address and coalesce, heap_lock held */
+static void freelist_insert(block_t* block) {
+    block_t** cur = &freelist;
+    while (*cur && *cur < block) {
+        cur = &(*cur)->next;
+    }
+
+    block->next = *cur;
+    *cur = block;
+
+    /* coalesce with next block if adjacent */
+    if (block->next && (uint8_t*)block + sizeof(block_t) + block->size ==
+                           (uint8_t*)block->next) {
+        block->size += sizeof(block_t) + block->next->size;
+        block->next = block->next->next;
+    }
+
+    /* coalesce with previous block if adjacent */
+    if (cur != &freelist) {
+        block_t* prev = freelist;
+        while (prev->next != block)
+            prev = prev->next;
+        if ((uint8_t*)prev + sizeof(block_t) + prev->size == (uint8_t*)block) {
+            prev->size += sizeof(block_t) + block->size;
+            prev->next = block->next;
+        }
+    }
+}
+
+/* Map a new arena with room for at least `size` bytes, heap_lock held */
+static bool heap_grow(size_t size) {
+    size_t pages = DIV_ROUND_UP(size + sizeof(arena_t) + sizeof(block_t),
+                                PAGE_SIZE);
+    if (pages < FF_POOL_SIZE)
+        pages = FF_POOL_SIZE;
+
+    spinlock_acquire(&map_lock);
+    arena_t* arena = valloc(kvm_ctx, pages, VALLOC_RW);
+    spinlock_release(&map_lock);
+    if (!arena)
+        return false;
+
+    arena->pages = pages;
+    arena->next = arenas;
+    arenas = arena;
+
+    block_t* block = arena_block(arena);
+    block->size = arena_capacity(arena);
+    freelist_insert(block);
+    return true;
+}
+
+/*
+ * PMM reclaimer: unmap every arena that is one whole free block, except
+ * the first one. Skips the round if the heap is busy, the allocation that
+ * got us here may be a heap_grow() holding the locks. map_lock is held
+ * until the arenas are unmapped, so a heap_grow() elsewhere can't touch
+ * kvm_ctx at the same time.
+ */
+static uint64_t heap_reclaim(void) {
+    arena_t* release = NULL;
+    uint64_t pages = 0;
+
+    uint64_t flags = irq_save();
+    if (!spinlock_try_acquire(&map_lock)) {
+        irq_restore(flags);
+        return 0;
+    }
+    if (!spinlock_try_acquire(&heap_lock)) {
+        spinlock_release(&map_lock);
+        irq_restore(flags);
+        return 0;
+    }
+
+    arena_t** link = &arenas;
+    while (*link) {
+        arena_t* arena = *link;
+        block_t* block = arena_block(arena);
+
+        block_t** cur = &freelist;
+        while (*cur && *cur < block)
+            cur = &(*cur)->next;
+
+        if (arena->next == NULL || *cur != block ||
+            block->size != arena_capacity(arena)) {
+            link = &arena->next;
+            continue;
+        }
+
+        *cur = block->next;
+        *link = arena->next;
+        arena->next = release;
+        release = arena;
+        pages += arena->pages;
+    }
+
+    spinlock_release(&heap_lock);
+
+    while (release) {
+        arena_t* next = release->next;
+        vfree(kvm_ctx, release);
+        release = next;
+    }
+
+    spinlock_release(&map_lock);
+    irq_restore(flags);
+    return pages;
+}
 
 void heap_init() {
-    pool = valloc(kvm_ctx, FF_POOL_SIZE, VALLOC_RW);
-    if (!pool)
+    spinlock_init(&heap_lock);
+    spinlock_init(&map_lock);
+    if (!heap_grow(0))
         kpanic(NULL, "Failed to alloc memory for the heap pool");
-    freelist = (block_t*)pool;
-    freelist->size = (FF_POOL_SIZE * PAGE_SIZE) - sizeof(block_t);
-    freelist->next = NULL;
-    log_early("Initialized heap with a pool of %d pages (~%dMB)", FF_POOL_SIZE,
+    pmm_add_reclaimer(heap_reclaim);
+    log_early("Initialized heap with a pool of %d pages (~%dMB), grows on "
+              "demand",
+              FF_POOL_SIZE,
               DIV_ROUND_UP(FF_POOL_SIZE * PAGE_SIZE, 1024 * 1024));
 }
 
-void* kmalloc(size_t size) {
-    if (size == 0)
-        return NULL;
-
-    size = ALIGN_UP(size, 8);
-
+/* First fit over the freelist, heap_lock held */
+static void* ff_alloc(size_t size) {
     block_t* prev = NULL;
     block_t* cur = freelist;
 
@@ -64,36 +188,182 @@ void* kmalloc(size_t size) {
     return NULL;
 }
 
-void kfree(void* ptr) {
-    if (!ptr)
+/* Split what's past `size` off a used block, if it makes a block */
+static void ff_trim(block_t* block, size_t size) {
+    if (block->size < size + 2 * sizeof(block_t))
         return;
 
+    block_t* tail = (block_t*)((uint8_t*)block + sizeof(block_t) + size);
+    tail->size = block->size - size - sizeof(block_t);
+    block->size = size;
+    freelist_insert(tail);
+}
+
+/* ff_alloc(), growing the heap if needed, takes heap_lock */
+static void* ff_malloc(size_t size) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    void* ptr = ff_alloc(size);
+    if (!ptr && heap_grow(size))
+        ptr = ff_alloc(size);
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+    return ptr;
+}
+
+static void ff_free(void* ptr) {
     block_t* block = (block_t*)((uint8_t*)ptr - sizeof(block_t));
 
-    /* insert block sorted by address in freelist */
-    block_t** cur = &freelist;
-    while (*cur && *cur < block) {
-        cur = &(*cur)->next;
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    freelist_insert(block);
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    void* ptr = ff_malloc(ALIGN_UP(size, 8));
+
+#if HEAP_PROFILE
+    if (ptr)
+        heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return ptr;
+}
+
+/*
+ * Over-allocate by the alignment, then move the block start up to the
+ * first aligned address that leaves room for a free block in front of it.
+ */
+void* kmalloc_aligned(size_t size, size_t align) {
+    if (size == 0 || (align & (align - 1)))
+        return NULL;
+
+    size_t aligned = ALIGN_UP(size, 8);
+    void* ptr;
+
+    if (align <= 8) {
+        ptr = ff_malloc(aligned);
+    } else {
+        size_t slack = align + 2 * sizeof(block_t);
+
+        uint64_t flags = irq_save();
+        spinlock_acquire(&heap_lock);
+        ptr = ff_alloc(aligned + slack);
+        if (!ptr && heap_grow(aligned + slack))
+            ptr = ff_alloc(aligned + slack);
+
+        if (ptr) {
+            block_t* block = (block_t*)((uint8_t*)ptr - sizeof(block_t));
+            uint64_t start = ALIGN_UP((uint64_t)ptr, align);
+            while (start != (uint64_t)ptr &&
+                   start - (uint64_t)ptr < 2 * sizeof(block_t))
+                start += align;
+
+            if (start != (uint64_t)ptr) {
+                uint64_t lead = start - (uint64_t)ptr;
+                block_t* moved = (block_t*)(start - sizeof(block_t));
+                moved->size = block->size - lead;
+                block->size = lead - sizeof(block_t);
+                freelist_insert(block);
+                block = moved;
+                ptr = (void*)start;
+            }
+            ff_trim(block, aligned);
+        }
+
+        spinlock_release(&heap_lock);
+        irq_restore(flags);
     }
 
-    block->next = *cur;
-    *cur = block;
+#if HEAP_PROFILE
+    if (ptr)
+        heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return ptr;
+}
 
-    /* coalesce with next block if adjacent */
-    if (block->next && (uint8_t*)block + sizeof(block_t) + block->size ==
-                           (uint8_t*)block->next) {
-        block->size += sizeof(block_t) + block->next->size;
-        block->next = block->next->next;
+/* Grows into the next block when it's free, copies only as a last resort */
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) {
+        ptr = size ? ff_malloc(ALIGN_UP(size, 8)) : NULL;
+#if HEAP_PROFILE
+        if (ptr)
+            heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+        return ptr;
     }
 
-    /* coalesce with previous block if adjacent */
-    if (cur != &freelist) {
-        block_t* prev = freelist;
-        while (prev->next != block)
-            prev = prev->next;
-        if ((uint8_t*)prev + sizeof(block_t) + prev->size == (uint8_t*)block) {
-            prev->size += sizeof(block_t) + block->size;
-            prev->next = block->next;
+#if HEAP_PROFILE
+    heap_profile_free(ptr);
+#endif // HEAP_PROFILE
+
+    if (size == 0) {
+        ff_free(ptr);
+        return NULL;
+    }
+
+    size_t aligned = ALIGN_UP(size, 8);
+    block_t* block = (block_t*)((uint8_t*)ptr - sizeof(block_t));
+    void* new = ptr;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+
+    if (block->size < aligned) {
+        block_t* end = (block_t*)((uint8_t*)ptr + block->size);
+        block_t** link = &freelist;
+        while (*link && *link < end)
+            link = &(*link)->next;
+
+        if (*link == end &&
+            block->size + sizeof(block_t) + end->size >= aligned) {
+            *link = end->next;
+            block->size += sizeof(block_t) + end->size;
         }
     }
+
+    size_t old_size = block->size;
+    if (old_size >= aligned)
+        ff_trim(block, aligned);
+
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
+
+    if (old_size < aligned) {
+        new = ff_malloc(aligned);
+        if (new) {
+            memcpy(new, ptr, old_size);
+            ff_free(ptr);
+        }
+    }
+
+#if HEAP_PROFILE
+    heap_profile_alloc(new ? new : ptr, new ? size : old_size,
+                       __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return new;
+}
+
+void kfree(void* ptr) {
+    if (!ptr)
+        return;
+
+#if HEAP_PROFILE
+    heap_profile_free(ptr);
+#endif // HEAP_PROFILE
+
+    ff_free(ptr);
+}
+
+void heap_walk_free(void (*fn)(size_t size)) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&heap_lock);
+    for (block_t* block = freelist; block; block = block->next)
+        fn(block->size);
+    spinlock_release(&heap_lock);
+    irq_restore(flags);
 }
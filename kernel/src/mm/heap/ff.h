@@ -8,7 +8,7 @@
 #include <stdint.h>
 
 #ifndef FF_POOL_SIZE
-#define FF_POOL_SIZE 512
+#define FF_POOL_SIZE 512 // Initial pool and minimum growth, in pages
 #endif // FF_POOL_SIZE
 
 typedef struct block {
@@ -16,4 +16,10 @@ typedef struct block {
     struct block* next;
 } block_t;
 
+/* Header of each valloc'd chunk the heap grows by, blocks follow it */
+typedef struct arena {
+    size_t pages;
+    struct arena* next;
+} arena_t;
+
 #endif // FF_H
@@ -0,0 +1,207 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
+#include <lib/string.h>
+#include <mm/heap.h>
+#include <sys/spinlock.h>
+#include <util/log.h>
+
+/*
+ * Heap profiler, built with CONFIG_KERNEL_HEAP_PROFILE. Every live
+ * allocation sits in an open addressed pointer table pointing at the call
+ * site that made it, sites keep running totals. Both tables are fixed size
+ * so the profiler never allocates, anything past them is only counted. The
+ * pointer table is linear probed with backward shift deletion, so it has no
+ * tombstones and is kept at most 3/4 full: a lookup stops at the first empty
+ * slot, which is never far away.
+ */
+#define PROFILE_SITES 256
+#define PROFILE_PTRS 16384 // Power of two
+#define PROFILE_PTRS_MAX (PROFILE_PTRS / 4 * 3)
+#define PROFILE_BUCKETS 32
+
+typedef struct {
+    void* site;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    uint64_t live_count;
+    uint64_t total_count;
+} profile_site_t;
+
+typedef struct {
+    uint64_t ptr; // 0 for empty
+    uint32_t size;
+    uint32_t site;
+} profile_ptr_t;
+
+static profile_site_t sites[PROFILE_SITES];
+static uint32_t site_count;
+static profile_ptr_t ptrs[PROFILE_PTRS];
+static uint32_t ptr_count;
+static uint64_t untracked;
+static uint64_t live_bytes;
+static uint64_t peak_bytes;
+static spinlock_t profile_lock;
+
+/* Fragmentation histogram, filled by heap_walk_free() on dump */
+static uint64_t frag_count[PROFILE_BUCKETS];
+static uint64_t frag_bytes[PROFILE_BUCKETS];
+static uint64_t frag_total;
+static uint64_t frag_largest;
+
+static inline uint32_t ptr_hash(uint64_t ptr) {
+    return (uint32_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 40) &
+           (PROFILE_PTRS - 1);
+}
+
+/* Index of `site`, allocating a slot for it if it's new, profile_lock held */
+static uint32_t site_index(void* site) {
+    for (uint32_t i = 0; i < site_count; i++) {
+        if (sites[i].site == site)
+            return i;
+    }
+
+    if (site_count == PROFILE_SITES)
+        return PROFILE_SITES;
+
+    sites[site_count].site = site;
+    return site_count++;
+}
+
+/*
+ * Empty a slot, moving later entries of its run back into the hole unless
+ * that would put them before their home slot, profile_lock held
+ */
+static void ptr_remove(uint32_t hole) {
+    uint32_t slot = hole;
+
+    while (true) {
+        slot = (slot + 1) & (PROFILE_PTRS - 1);
+        if (!ptrs[slot].ptr)
+            break;
+
+        /* It can move back unless the hole is before its home slot */
+        uint32_t home = ptr_hash(ptrs[slot].ptr);
+        if (((slot - home) & (PROFILE_PTRS - 1)) >=
+            ((slot - hole) & (PROFILE_PTRS - 1))) {
+            ptrs[hole] = ptrs[slot];
+            hole = slot;
+        }
+    }
+
+    ptrs[hole].ptr = 0;
+}
+
+void heap_profile_alloc(void* ptr, size_t size, void* site) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&profile_lock);
+
+    uint32_t idx = site_index(site);
+    uint32_t slot = ptr_hash((uint64_t)ptr);
+
+    if (idx == PROFILE_SITES || ptr_count == PROFILE_PTRS_MAX) {
+        untracked++;
+    } else {
+        while (ptrs[slot].ptr)
+            slot = (slot + 1) & (PROFILE_PTRS - 1);
+
+        ptr_count++;
+        ptrs[slot].ptr = (uint64_t)ptr;
+        ptrs[slot].size = (uint32_t)size;
+        ptrs[slot].site = idx;
+
+        profile_site_t* s = &sites[idx];
+        s->live_bytes += size;
+        s->live_count++;
+        s->total_count++;
+        if (s->live_bytes > s->peak_bytes)
+            s->peak_bytes = s->live_bytes;
+
+        live_bytes += size;
+        if (live_bytes > peak_bytes)
+            peak_bytes = live_bytes;
+    }
+
+    spinlock_release(&profile_lock);
+    irq_restore(flags);
+}
+
+void heap_profile_free(void* ptr) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&profile_lock);
+
+    uint32_t slot = ptr_hash((uint64_t)ptr);
+    while (ptrs[slot].ptr && ptrs[slot].ptr != (uint64_t)ptr)
+        slot = (slot + 1) & (PROFILE_PTRS - 1);
+
+    if (ptrs[slot].ptr) {
+        profile_site_t* s = &sites[ptrs[slot].site];
+        s->live_bytes -= ptrs[slot].size;
+        s->live_count--;
+        live_bytes -= ptrs[slot].size;
+        ptr_count--;
+        ptr_remove(slot);
+    }
+
+    spinlock_release(&profile_lock);
+    irq_restore(flags);
+}
+
+static void frag_account(size_t size) {
+    uint32_t bucket = size ? 63 - __builtin_clzll(size) : 0;
+    if (bucket >= PROFILE_BUCKETS)
+        bucket = PROFILE_BUCKETS - 1;
+
+    frag_count[bucket]++;
+    frag_bytes[bucket] += size;
+    frag_total += size;
+    if (size > frag_largest)
+        frag_largest = size;
+}
+
+void heap_profile_dump(void) {
+    static profile_site_t snapshot[PROFILE_SITES];
+    uint32_t count;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&profile_lock);
+    memcpy(snapshot, sites, sizeof(sites));
+    count = site_count;
+    log("heap: %llu bytes live, %llu peak, %llu allocations untracked",
+        live_bytes, peak_bytes, untracked);
+    spinlock_release(&profile_lock);
+    irq_restore(flags);
+
+    /* Biggest live footprint first, insertion sort on the copy */
+    for (uint32_t i = 1; i < count; i++) {
+        profile_site_t s = snapshot[i];
+        uint32_t j = i;
+        while (j > 0 && snapshot[j - 1].live_bytes < s.live_bytes) {
+            snapshot[j] = snapshot[j - 1];
+            j--;
+        }
+        snapshot[j] = s;
+    }
+
+    log("heap: %-18s %12s %12s %10s %10s", "site", "live", "peak", "live#",
+        "total#");
+    for (uint32_t i = 0; i < count; i++) {
+        log("heap: 0x%.16llx %12llu %12llu %10llu %10llu",
+            (uint64_t)snapshot[i].site,
+            snapshot[i].live_bytes, snapshot[i].peak_bytes,
+            snapshot[i].live_count, snapshot[i].total_count);
+    }
+
+    memset(frag_count, 0, sizeof(frag_count));
+    memset(frag_bytes, 0, sizeof(frag_bytes));
+    frag_total = frag_largest = 0;
+    heap_walk_free(frag_account);
+
+    log("heap: %llu bytes free, largest free chunk %llu (%llu%% fragmented)",
+        frag_total, frag_largest,
+        frag_total ? 100 - frag_largest * 100 / frag_total : 0);
+    for (uint32_t i = 0; i < PROFILE_BUCKETS; i++) {
+        if (frag_count[i])
+            log("heap:   free chunks %8llu+ bytes: %8llu (%llu bytes)",
+                1ULL << i, frag_count[i], frag_bytes[i]);
+    }
+}
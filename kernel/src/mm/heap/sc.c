@@ -0,0 +1,212 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
+#include <boot/emk.h>
+#include <lib/string.h>
+#include <mm/heap.h>
+#include <mm/heap/sc.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <sys/kpanic.h>
+#include <util/align.h>
+#include <util/kprintf.h>
+#include <util/log.h>
+
+/*
+ * Small requests are rounded up to one of a few size classes, each its own
+ * slab cache, so they get O(1) per-CPU alloc/free and the slab locking.
+ * Both slabs and large allocations keep a magic at the start of the page
+ * holding the byte before the pointer, which is how kfree() tells them
+ * apart. Classes are naturally aligned to their lowest set bit, which costs
+ * no objects per slab and lets kmalloc_aligned() use them directly.
+ */
+static const size_t class_sizes[] = {16,  32,  48,  64,  96,  128,
+                                     192, 256, 384, 512, 768, 1024};
+#define CLASS_COUNT (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+static slab_cache_t classes[CLASS_COUNT];
+static char class_names[CLASS_COUNT][16];
+static uint8_t class_index[SC_MAX_SIZE / 16 + 1]; // By size in 16 byte units
+
+void heap_init() {
+    uint32_t c = 0;
+
+    for (uint32_t i = 0; i < CLASS_COUNT; i++) {
+        snprintf(class_names[i], sizeof(class_names[i]), "kmalloc-%llu",
+                     (uint64_t)class_sizes[i]);
+        slab_cache_init(&classes[i], class_names[i], class_sizes[i],
+                        class_sizes[i] & -class_sizes[i], NULL);
+    }
+
+    for (uint32_t i = 0; i <= SC_MAX_SIZE / 16; i++) {
+        while (class_sizes[c] < i * 16)
+            c++;
+        class_index[i] = c;
+    }
+
+    log_early("Initialized size-class heap with %d classes up to %d bytes",
+              CLASS_COUNT, SC_MAX_SIZE);
+}
+
+static inline sc_large_t* header_of(void* ptr) {
+    return (sc_large_t*)ALIGN_DOWN((uint64_t)ptr - 1, PAGE_SIZE);
+}
+
+static void* large_alloc(size_t size, size_t align) {
+    size_t offset = ALIGN_UP(sizeof(sc_large_t), align);
+    uint64_t pages = DIV_ROUND_UP(size + offset, PAGE_SIZE);
+    if (align > PAGE_SIZE)
+        pages += align / PAGE_SIZE - 1;
+
+    uint8_t* base = pallocf(pages, PALLOC_HIGHER_HALF | PALLOC_NOZERO);
+    if (!base)
+        return NULL;
+
+    uint64_t ptr = ALIGN_UP((uint64_t)base + sizeof(sc_large_t), align);
+    sc_large_t* large = header_of((void*)ptr);
+    large->magic = SC_LARGE_MAGIC;
+    large->pages = pages;
+    large->base = base;
+    large->ptr = (void*)ptr;
+    return (void*)ptr;
+}
+
+/* Usable bytes at ptr, panics if it isn't ours */
+static size_t capacity_of(void* ptr) {
+    slab_t* slab = (slab_t*)header_of(ptr);
+    if (slab->magic == SLAB_MAGIC)
+        return slab->cache->size;
+
+    sc_large_t* large = (sc_large_t*)slab;
+    if (large->magic != SC_LARGE_MAGIC || large->ptr != ptr)
+        kpanic(NULL, "kfree: %p was not allocated by kmalloc", ptr);
+
+    return (uint8_t*)large->base + large->pages * PAGE_SIZE - (uint8_t*)ptr;
+}
+
+static void sc_free(void* ptr) {
+    slab_t* slab = (slab_t*)header_of(ptr);
+    if (slab->magic == SLAB_MAGIC) {
+        slab_free(slab->cache, ptr);
+        return;
+    }
+
+    sc_large_t* large = (sc_large_t*)slab;
+    if (large->magic != SC_LARGE_MAGIC || large->ptr != ptr)
+        kpanic(NULL, "kfree: %p was not allocated by kmalloc", ptr);
+
+    large->magic = 0;
+    pfree(large->base, large->pages);
+}
+
+static void* sc_malloc(size_t size) {
+    if (size <= SC_MAX_SIZE)
+        return slab_alloc(&classes[class_index[DIV_ROUND_UP(size, 16)]]);
+    return large_alloc(size, 16);
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    void* ptr = sc_malloc(size);
+
+#if HEAP_PROFILE
+    if (ptr)
+        heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return ptr;
+}
+
+void* kmalloc_aligned(size_t size, size_t align) {
+    if (size == 0 || (align & (align - 1)))
+        return NULL;
+    if (align < 16)
+        align = 16;
+
+    void* ptr = NULL;
+    if (size <= SC_MAX_SIZE && align <= SC_MAX_SIZE) {
+        /* First class that's big enough and aligned enough */
+        for (uint32_t c = class_index[DIV_ROUND_UP(size, 16)]; c < CLASS_COUNT;
+             c++) {
+            if ((class_sizes[c] & -class_sizes[c]) >= align) {
+                ptr = slab_alloc(&classes[c]);
+                break;
+            }
+        }
+    } else {
+        ptr = large_alloc(size, align);
+    }
+
+#if HEAP_PROFILE
+    if (ptr)
+        heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return ptr;
+}
+
+/* Stays put while the new size fits the class or pages it already has */
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) {
+        ptr = size ? sc_malloc(size) : NULL;
+#if HEAP_PROFILE
+        if (ptr)
+            heap_profile_alloc(ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+        return ptr;
+    }
+
+#if HEAP_PROFILE
+    heap_profile_free(ptr);
+#endif // HEAP_PROFILE
+
+    if (size == 0) {
+        sc_free(ptr);
+        return NULL;
+    }
+
+    size_t cap = capacity_of(ptr);
+    void* new = ptr;
+    if (size > cap) {
+        new = sc_malloc(size);
+        if (new) {
+            memcpy(new, ptr, cap);
+            sc_free(ptr);
+        }
+    }
+
+#if HEAP_PROFILE
+    heap_profile_alloc(new ? new : ptr, size, __builtin_return_address(0));
+#endif // HEAP_PROFILE
+    return new;
+}
+
+void kfree(void* ptr) {
+    if (!ptr)
+        return;
+
+#if HEAP_PROFILE
+    heap_profile_free(ptr);
+#endif // HEAP_PROFILE
+
+    sc_free(ptr);
+}
+
+/* Free objects still in the slabs, per-CPU cached ones aren't counted */
+void heap_walk_free(void (*fn)(size_t size)) {
+    for (uint32_t i = 0; i < CLASS_COUNT; i++) {
+        slab_cache_t* cache = &classes[i];
+
+        uint64_t flags = irq_save();
+        spinlock_acquire(&cache->lock);
+        for (slab_t* slab = cache->partial; slab; slab = slab->next) {
+            for (uint32_t n = slab->inuse; n < cache->per_slab; n++)
+                fn(cache->size);
+        }
+        if (cache->empty) {
+            for (uint32_t n = 0; n < cache->per_slab; n++)
+                fn(cache->size);
+        }
+        spinlock_release(&cache->lock);
+        irq_restore(flags);
+    }
+}
@@ -0,0 +1,24 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef SC_H
+#define SC_H
+
+/* Size-class heap on top of the slab allocator */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SC_MAX_SIZE 1024 // Anything bigger gets its own pages
+#define SC_LARGE_MAGIC 0x5C1A46E5C1A46E00
+
+/*
+ * Sits at the start of the page holding the byte before a large allocation,
+ * which is the first page unless it was aligned past PAGE_SIZE.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t pages; // Of the whole run starting at base
+    void* base;
+    void* ptr; // Payload, to catch frees of pointers into the middle
+} sc_large_t;
+
+#endif // SC_H
@@ -0,0 +1,140 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <mm/numa.h>
+#include <mm/pmm.h>
+#include <stdbool.h>
+#include <sys/acpi/srat.h>
+#include <util/align.h>
+#include <util/log.h>
+
+/*
+ * Nodes are numbered densely in the order SRAT mentions their proximity
+ * domains, node_domain[] maps them back for SLIT lookups.
+ */
+uint32_t numa_node_count = 1;
+static uint32_t node_domain[NUMA_MAX_NODES] = {0};
+static uint32_t nodes = 0;
+
+static numa_range_t ranges[256];
+static uint32_t range_count = 0;
+
+static uint32_t node_of_domain(uint32_t domain, bool create) {
+    for (uint32_t i = 0; i < nodes; i++) {
+        if (node_domain[i] == domain)
+            return i;
+    }
+
+    if (!create)
+        return 0;
+
+    if (nodes >= NUMA_MAX_NODES) {
+        log_early("warning: NUMA: too many nodes, folding domain %u into 0",
+                  domain);
+        return 0;
+    }
+
+    node_domain[nodes] = domain;
+    return nodes++;
+}
+
+static inline uint32_t lapic_domain(acpi_srat_lapic_t* lapic) {
+    return lapic->domain_lo | (lapic->domain_hi[0] << 8) |
+           (lapic->domain_hi[1] << 16) | ((uint32_t)lapic->domain_hi[2] << 24);
+}
+
+static void add_range(uint64_t start, uint64_t end, uint32_t node) {
+    if (end > pmm_page_count)
+        end = pmm_page_count;
+    if (start >= end || range_count >= 256)
+        return;
+
+    /* Keep the list sorted by start */
+    uint32_t i = range_count++;
+    while (i > 0 && ranges[i - 1].start > start) {
+        ranges[i] = ranges[i - 1];
+        i--;
+    }
+    ranges[i] = (numa_range_t){start, end, node};
+}
+
+void numa_init(void) {
+    srat_init();
+
+    for (uint32_t i = 0; i < srat_memory_len; i++) {
+        acpi_srat_memory_t* mem = srat_memory_list[i];
+        uint32_t node = node_of_domain(mem->domain, true);
+        add_range(DIV_ROUND_UP(mem->base, PAGE_SIZE),
+                  (mem->base + mem->length) / PAGE_SIZE, node);
+    }
+
+    /* Memoryless nodes still need a number for their CPUs */
+    for (uint32_t i = 0; i < srat_lapic_len; i++)
+        node_of_domain(lapic_domain(srat_lapic_list[i]), true);
+    for (uint32_t i = 0; i < srat_x2apic_len; i++)
+        node_of_domain(srat_x2apic_list[i]->domain, true);
+
+    if (range_count == 0 || nodes <= 1) {
+        log_early("NUMA: single node");
+        return;
+    }
+
+    /*
+     * Make the ranges tile all of physical memory: overlaps are trimmed and
+     * holes go to the node before them, so every page lands in some zone.
+     */
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < range_count; i++) {
+        numa_range_t r = ranges[i];
+        if (out > 0) {
+            if (r.start < ranges[out - 1].end)
+                r.start = ranges[out - 1].end;
+            if (r.start >= r.end)
+                continue;
+            ranges[out - 1].end = r.start;
+            if (ranges[out - 1].node == r.node) {
+                ranges[out - 1].end = r.end;
+                continue;
+            }
+        }
+        ranges[out++] = r;
+    }
+    range_count = out;
+    ranges[0].start = 0;
+    ranges[range_count - 1].end = pmm_page_count;
+
+    numa_node_count = nodes;
+    for (uint32_t i = 0; i < numa_node_count; i++) {
+        log_early("NUMA: node %u is proximity domain %u, distances:", i,
+                  node_domain[i]);
+        for (uint32_t j = 0; j < numa_node_count; j++)
+            log_early("  -> node %u: %u", j, numa_distance(i, j));
+    }
+
+    pmm_numa_init(ranges, range_count);
+}
+
+uint32_t numa_node_of_lapic(uint32_t lapic_id) {
+    if (numa_node_count == 1)
+        return 0;
+
+    for (uint32_t i = 0; i < srat_lapic_len; i++) {
+        if (srat_lapic_list[i]->apic_id == lapic_id)
+            return node_of_domain(lapic_domain(srat_lapic_list[i]), false);
+    }
+
+    for (uint32_t i = 0; i < srat_x2apic_len; i++) {
+        if (srat_x2apic_list[i]->x2apic_id == lapic_id)
+            return node_of_domain(srat_x2apic_list[i]->domain, false);
+    }
+
+    return 0;
+}
+
+uint8_t numa_distance(uint32_t from, uint32_t to) {
+    uint32_t a = node_domain[from];
+    uint32_t b = node_domain[to];
+
+    if (slit && a < slit->localities && b < slit->localities)
+        return slit->entries[a * slit->localities + b];
+
+    return from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+}
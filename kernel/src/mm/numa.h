@@ -0,0 +1,24 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdint.h>
+
+#define NUMA_MAX_NODES 8
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+/* Physical memory owned by a node, in page frame numbers */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint32_t node;
+} numa_range_t;
+
+extern uint32_t numa_node_count;
+
+void numa_init(void);
+uint32_t numa_node_of_lapic(uint32_t lapic_id);
+uint8_t numa_distance(uint32_t from, uint32_t to);
+
+#endif // NUMA_H
@@ -1,32 +1,251 @@
 /* EMK 1.0 Copyright (c) 2025 Piraterna */
 #include <arch/cpu.h>
+#include <arch/smp.h>
 #include <boot/emk.h>
-#include <lib/bitmap.h>
 #include <lib/string.h>
+#include <mm/numa.h>
 #include <mm/pmm.h>
+#include <sys/kpanic.h>
 #include <sys/spinlock.h>
 #include <util/align.h>
 #include <util/log.h>
 
-#define PAGE_CACHE_SIZE 1024
 #define MIN_ALIGN PAGE_SIZE
-#define BITMAP_WORD_SIZE (sizeof(uint64_t) * 8)
+#define PMM_ZERO_POOL_SIZE 256
 
-uint64_t bitmap_pages;
-uint64_t bitmap_size;
-uint8_t* bitmap;
+uint64_t pmm_page_count;
 static uint64_t free_pages;
 static spinlock_t pmm_lock;
-static uint64_t page_cache[PAGE_CACHE_SIZE];
-static size_t cache_size;
-static size_t cache_index;
+
+/*
+ * Zones are page frame ranges handed to the backend separately, one per
+ * NUMA node range and address class. Retired zones (after pmm_numa_init())
+ * keep their slot with start == end so backend state indexed by zone id
+ * stays put.
+ */
+static pmm_zone_t zones[PMM_MAX_ZONES];
+static uint32_t zone_count;
+
+/*
+ * Zones to try for each node: local ones first, then by SLIT distance, high
+ * zones before low ones on every node. The tiny DMA zones of all nodes come
+ * last so ordinary allocations only dip into them when all else is gone.
+ */
+static pmm_zone_t* zonelists[NUMA_MAX_NODES][PMM_MAX_ZONES];
+static uint32_t zonelist_len[NUMA_MAX_NODES];
+
+/* Free pages known to be zero, filled by idle CPUs through pmm_scrub() */
+typedef struct {
+    uint64_t pages[PMM_ZERO_POOL_SIZE];
+    size_t count;
+    spinlock_t lock;
+} pmm_zero_pool_t;
+
+/* One per node, so a CPU only ever gets zeroed pages from its own node */
+static pmm_zero_pool_t zero_pools[NUMA_MAX_NODES];
+static uint64_t zero_hits;
+static uint64_t zero_misses;
+static uint64_t zero_scrubbed;
+
+/* References beyond the first per page frame, so fresh pages need no setup */
+static uint32_t* page_refs;
+
+static pmm_reclaim_t reclaimers[PMM_MAX_RECLAIMERS];
+static uint32_t reclaimer_count;
 
 static inline bool is_aligned(void* addr, size_t align) {
     return ((uintptr_t)addr % align) == 0;
 }
 
+static inline void zero_pages(uint64_t addr, size_t pages) {
+    void* dest = HIGHER_HALF(addr);
+    size_t count = pages * PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile("rep stosq"
+                     : "+D"(dest), "+c"(count)
+                     : "a"(0ULL)
+                     : "memory");
+}
+
+static inline uint32_t current_node(void) {
+    cpu_local_t* cpu = cpu_local_try();
+    return cpu ? cpu->numa_node : 0;
+}
+
+/* Carve backend metadata out of the first usable region big enough */
+void* pmm_early_alloc(size_t size) {
+    size = ALIGN_UP(size, PAGE_SIZE);
+
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry* e = memmap->entries[i];
+        if (e->type == LIMINE_MEMMAP_USABLE && e->length >= size) {
+            void* ptr = (void*)(e->base + hhdm_offset);
+            e->base += size;
+            e->length -= size;
+            return ptr;
+        }
+    }
+
+    kpanic(NULL, "pmm: no usable region for %llu bytes of metadata", size);
+    return NULL;
+}
+
+static const char* zone_names[PMM_ZONE_TYPES] = {"DMA", "DMA32", "Normal"};
+
+static pmm_zone_t* zone_new(uint32_t node, uint32_t type, uint64_t start,
+                            uint64_t end) {
+    if (zone_count >= PMM_MAX_ZONES)
+        kpanic(NULL, "pmm: out of zones (max %d)", PMM_MAX_ZONES);
+
+    pmm_zone_t* zone = &zones[zone_count];
+    memset(zone, 0, sizeof(pmm_zone_t));
+    zone->id = zone_count++;
+    zone->node = node;
+    zone->type = type;
+    zone->start = start;
+    zone->end = end;
+
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry* e = memmap->entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE)
+            continue;
+
+        uint64_t lo = e->base / PAGE_SIZE;
+        uint64_t hi = (e->base + e->length) / PAGE_SIZE;
+        if (lo < start)
+            lo = start;
+        if (hi > end)
+            hi = end;
+        if (lo < hi)
+            zone->present += hi - lo;
+    }
+
+    pmm_backend_zone_init(zone);
+    return zone;
+}
+
+/* Create the zones for a node range, cut at the DMA and DMA32 limits */
+static void zone_create(uint32_t node, uint64_t start, uint64_t end) {
+    static const uint64_t limits[PMM_ZONE_TYPES] = {
+        PMM_DMA_LIMIT / PAGE_SIZE, PMM_DMA32_LIMIT / PAGE_SIZE, UINT64_MAX};
+
+    for (uint32_t type = 0; type < PMM_ZONE_TYPES && start < end; type++) {
+        if (start >= limits[type])
+            continue;
+
+        uint64_t top = end < limits[type] ? end : limits[type];
+        zone_new(node, type, start, top);
+        start = top;
+    }
+}
+
+static pmm_zone_t* zone_of(uint64_t pfn) {
+    for (uint32_t i = 0; i < zone_count; i++) {
+        if (pfn >= zones[i].start && pfn < zones[i].end)
+            return &zones[i];
+    }
+    return NULL;
+}
+
+/* Give a page range to the zones covering it, pmm_lock held */
+static void zone_add_range(uint64_t pfn, uint64_t count) {
+    uint64_t end = pfn + count;
+
+    while (pfn < end) {
+        pmm_zone_t* zone = zone_of(pfn);
+        if (!zone) {
+            pfn++;
+            continue;
+        }
+
+        uint64_t n = (end < zone->end ? end : zone->end) - pfn;
+        pmm_backend_add(zone, pfn, n);
+        zone->free_pages += n;
+        free_pages += n;
+        pfn += n;
+    }
+}
+
+/* Free a page range back to its zones, pmm_lock held */
+static void zone_free_range(uint64_t pfn, uint64_t count) {
+    uint64_t end = pfn + count;
+
+    while (pfn < end) {
+        pmm_zone_t* zone = zone_of(pfn);
+        if (!zone)
+            return;
+
+        uint64_t n = (end < zone->end ? end : zone->end) - pfn;
+        uint64_t freed = pmm_backend_free(zone, pfn, n);
+        zone->free_pages += freed;
+        free_pages += freed;
+        pfn += n;
+    }
+}
+
+/* Allocate from the calling CPU's zonelist, pmm_lock held */
+static uint64_t zone_alloc(size_t pages, uint32_t max_type) {
+    uint32_t node = current_node();
+
+    for (uint32_t i = 0; i < zonelist_len[node]; i++) {
+        pmm_zone_t* zone = zonelists[node][i];
+        if (zone->type > max_type || zone->free_pages < pages)
+            continue;
+
+        uint64_t pfn = pmm_backend_alloc(zone, pages);
+        if (pfn != PMM_NO_PAGE) {
+            zone->free_pages -= pages;
+            free_pages -= pages;
+            return pfn;
+        }
+    }
+
+    return PMM_NO_PAGE;
+}
+
+static void zonelist_add(uint32_t node, uint32_t from, uint32_t type) {
+    for (uint32_t z = 0; z < zone_count; z++) {
+        pmm_zone_t* zone = &zones[z];
+        if (zone->node == from && zone->type == type &&
+            zone->start != zone->end)
+            zonelists[node][zonelist_len[node]++] = zone;
+    }
+}
+
+static void build_zonelists(void) {
+    for (uint32_t node = 0; node < numa_node_count; node++) {
+        bool used[NUMA_MAX_NODES] = {0};
+        zonelist_len[node] = 0;
+
+        /* Nodes by increasing distance, selection sort is plenty for 8 */
+        for (uint32_t n = 0; n < numa_node_count; n++) {
+            uint32_t best = NUMA_MAX_NODES;
+            for (uint32_t c = 0; c < numa_node_count; c++) {
+                if (used[c])
+                    continue;
+                if (best == NUMA_MAX_NODES ||
+                    numa_distance(node, c) < numa_distance(node, best) ||
+                    (c == node &&
+                     numa_distance(node, c) == numa_distance(node, best)))
+                    best = c;
+            }
+            used[best] = true;
+
+            for (uint32_t type = PMM_ZONE_NORMAL; type > PMM_ZONE_DMA; type--)
+                zonelist_add(node, best, type);
+        }
+
+        for (uint32_t n = 0; n < numa_node_count; n++)
+            zonelist_add(node, n == 0 ? node : (n == node ? 0 : n),
+                         PMM_ZONE_DMA);
+    }
+}
+
 void pmm_init(void) {
     spinlock_init(&pmm_lock);
+    for (uint32_t n = 0; n < NUMA_MAX_NODES; n++) {
+        spinlock_init(&zero_pools[n].lock);
+        zero_pools[n].count = 0;
+    }
 
     uint64_t high = 0;
     free_pages = 0;
@@ -37,121 +256,421 @@ void pmm_init(void) {
             uint64_t top = e->base + e->length;
             if (top > high)
                 high = top;
-            free_pages += e->length / PAGE_SIZE;
             log_early("Usable memory region: 0x%.16llx -> 0x%.16llx", e->base,
                       e->base + e->length);
         }
     }
 
-    bitmap_pages = high / PAGE_SIZE;
-    bitmap_size = ALIGN_UP(bitmap_pages / 8, PAGE_SIZE);
+    pmm_page_count = high / PAGE_SIZE;
+    pmm_backend_init(pmm_page_count);
 
-    for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry* e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE && e->length >= bitmap_size) {
-            bitmap = (uint8_t*)(e->base + hhdm_offset);
-            memset(bitmap, 0xFF, bitmap_size);
-            e->base += bitmap_size;
-            e->length -= bitmap_size;
-            free_pages -= bitmap_size / PAGE_SIZE;
-            break;
-        }
-    }
+    page_refs = pmm_early_alloc(pmm_page_count * sizeof(uint32_t));
+    memset(page_refs, 0, pmm_page_count * sizeof(uint32_t));
 
-    cache_size = PAGE_CACHE_SIZE;
-    cache_index = 0;
-    memset(page_cache, 0, sizeof(page_cache));
+    zone_count = 0;
+    zone_create(0, 0, pmm_page_count);
 
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE) {
-            for (uint64_t j = e->base; j < e->base + e->length;
-                 j += PAGE_SIZE) {
-                if ((j / PAGE_SIZE) < bitmap_pages) {
-                    bitmap_clear(bitmap, j / PAGE_SIZE);
-                }
-            }
-        }
+        if (e->type == LIMINE_MEMMAP_USABLE && e->length)
+            zone_add_range(e->base / PAGE_SIZE, e->length / PAGE_SIZE);
     }
+
+    build_zonelists();
 }
 
-void* palloc(size_t pages, bool higher_half) {
-    if (pages == 0 || pages > free_pages)
-        return NULL;
+static void rezone_drain(uint64_t pfn, uint64_t count) {
+    zone_add_range(pfn, count);
+}
 
+/* Split the flat boot zones along NUMA node boundaries */
+void pmm_numa_init(const numa_range_t* ranges, uint32_t count) {
+    uint64_t flags = irq_save();
     spinlock_acquire(&pmm_lock);
 
-    if (pages == 1 && cache_index > 0) {
-        void* addr = (void*)(page_cache[--cache_index] * PAGE_SIZE);
-        bitmap_set(bitmap, (uint64_t)addr / PAGE_SIZE);
-        free_pages--;
-        memset(HIGHER_HALF(addr), 0, pages * PAGE_SIZE);
+    uint32_t old_count = zone_count;
+    for (uint32_t i = 0; i < count; i++)
+        zone_create(ranges[i].node, ranges[i].start, ranges[i].end);
+
+    for (uint32_t i = 0; i < old_count; i++) {
+        pmm_zone_t old = zones[i];
+        zones[i].start = zones[i].end = 0;
+        zones[i].present = zones[i].free_pages = 0;
+        free_pages -= old.free_pages;
+        pmm_backend_drain(&old, rezone_drain);
+    }
+
+    build_zonelists();
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+
+    for (uint32_t i = old_count; i < zone_count; i++)
+        log_early("pmm: zone %u (%s) on node %u: 0x%.16llx -> 0x%.16llx, "
+                  "%llu free",
+                  i, zone_names[zones[i].type], zones[i].node,
+                  zones[i].start * PAGE_SIZE, zones[i].end * PAGE_SIZE,
+                  zones[i].free_pages);
+}
+
+/*
+ * Per-CPU magazines: single page allocations and frees are served from
+ * cpu_local_t without touching pmm_lock, which is only taken to refill or
+ * drain PMM_MAG_BATCH pages at a time.
+ */
+static uint64_t mag_alloc(void) {
+    cpu_local_t* cpu = cpu_local_try();
+    if (!cpu)
+        return 0;
+
+    uint64_t flags = irq_save();
+    pmm_magazine_t* mag = &cpu->pmm_mag;
+
+    if (mag->count == 0) {
+        mag->alloc_misses++;
+        spinlock_acquire(&pmm_lock);
+        while (mag->count < PMM_MAG_BATCH) {
+            uint64_t pfn = zone_alloc(1, PMM_ZONE_NORMAL);
+            if (pfn == PMM_NO_PAGE)
+                break;
+            mag->pages[mag->count++] = pfn;
+        }
         spinlock_release(&pmm_lock);
-        return higher_half ? (void*)((uint64_t)addr + hhdm_offset) : addr;
-    }
-
-    uint64_t word_count =
-        (bitmap_pages + BITMAP_WORD_SIZE - 1) / BITMAP_WORD_SIZE;
-    uint64_t* bitmap_words = (uint64_t*)bitmap;
-
-    for (uint64_t i = 0; i < word_count; i++) {
-        if (bitmap_words[i] != UINT64_MAX) {
-            uint64_t start_bit = i * BITMAP_WORD_SIZE;
-            uint64_t consecutive = 0;
-
-            for (uint64_t j = 0;
-                 j < BITMAP_WORD_SIZE && start_bit + j < bitmap_pages; j++) {
-                if (!bitmap_get(bitmap, start_bit + j)) {
-                    if (++consecutive == pages) {
-                        for (uint64_t k = 0; k < pages; k++) {
-                            bitmap_set(bitmap, start_bit + j - pages + 1 + k);
-                        }
-                        free_pages -= pages;
-
-                        void* addr =
-                            (void*)((start_bit + j - pages + 1) * PAGE_SIZE);
-                        memset(HIGHER_HALF(addr), 0, pages * PAGE_SIZE);
-                        spinlock_release(&pmm_lock);
-                        return higher_half
-                                   ? (void*)((uint64_t)addr + hhdm_offset)
-                                   : addr;
-                    }
-                } else {
-                    consecutive = 0;
-                }
-            }
+        if (mag->count == 0) {
+            irq_restore(flags);
+            return 0;
         }
+    } else {
+        mag->alloc_hits++;
     }
 
+    uint64_t addr = mag->pages[--mag->count] * PAGE_SIZE;
+    irq_restore(flags);
+    return addr;
+}
+
+static bool mag_free(uint64_t page) {
+    cpu_local_t* cpu = cpu_local_try();
+    if (!cpu)
+        return false;
+
+    /* Remote pages go home instead of lingering in this node's magazine */
+    if (numa_node_count > 1) {
+        pmm_zone_t* zone = zone_of(page);
+        if (!zone || zone->node != cpu->numa_node)
+            return false;
+    }
+
+    uint64_t flags = irq_save();
+    pmm_magazine_t* mag = &cpu->pmm_mag;
+
+    if (mag->count == PMM_MAG_SIZE) {
+        /* Drain the coldest half, keep the recently freed pages hot */
+        mag->free_misses++;
+        spinlock_acquire(&pmm_lock);
+        for (size_t i = 0; i < PMM_MAG_BATCH; i++)
+            zone_free_range(mag->pages[i], 1);
+        spinlock_release(&pmm_lock);
+
+        memmove(mag->pages, mag->pages + PMM_MAG_BATCH,
+                (PMM_MAG_SIZE - PMM_MAG_BATCH) * sizeof(uint64_t));
+        mag->count -= PMM_MAG_BATCH;
+    } else {
+        mag->free_hits++;
+    }
+
+    mag->pages[mag->count++] = page;
+    irq_restore(flags);
+    return true;
+}
+
+static uint64_t zero_pool_pop(void) {
+    pmm_zero_pool_t* pool = &zero_pools[current_node()];
+    uint64_t addr = 0;
+
+    // Don't take the lock just to find the pool empty
+    if (__atomic_load_n(&pool->count, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pool->lock);
+    if (pool->count > 0)
+        addr = pool->pages[--pool->count] * PAGE_SIZE;
+    spinlock_release(&pool->lock);
+    irq_restore(flags);
+    return addr;
+}
+
+/* Hand every pooled page back to the backend, for when memory runs short */
+static void zero_pool_drain(void) {
+    for (uint32_t n = 0; n < numa_node_count; n++) {
+        pmm_zero_pool_t* pool = &zero_pools[n];
+        if (__atomic_load_n(&pool->count, __ATOMIC_RELAXED) == 0)
+            continue;
+
+        uint64_t flags = irq_save();
+        spinlock_acquire(&pool->lock);
+        spinlock_acquire(&pmm_lock);
+        while (pool->count > 0)
+            zone_free_range(pool->pages[--pool->count], 1);
+        spinlock_release(&pmm_lock);
+        spinlock_release(&pool->lock);
+        irq_restore(flags);
+    }
+}
+
+/* Return this CPU's magazine to the backend so multi-page runs can form */
+static void mag_flush(void) {
+    cpu_local_t* cpu = cpu_local_try();
+    if (!cpu)
+        return;
+
+    uint64_t flags = irq_save();
+    pmm_magazine_t* mag = &cpu->pmm_mag;
+    spinlock_acquire(&pmm_lock);
+    while (mag->count > 0)
+        zone_free_range(mag->pages[--mag->count], 1);
     spinlock_release(&pmm_lock);
-    return NULL;
+    irq_restore(flags);
+}
+
+void pmm_add_reclaimer(pmm_reclaim_t fn) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+    if (reclaimer_count < PMM_MAX_RECLAIMERS)
+        reclaimers[reclaimer_count++] = fn;
+    else
+        fn = NULL;
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+
+    if (!fn)
+        log("warning: pmm: too many reclaimers, dropping one");
+}
+
+/*
+ * Out of memory: give back the zero pool and local magazine, then ask the
+ * reclaimers to release whatever they cache. They run without the PMM
+ * lock and must not block on locks their own allocations could hold.
+ */
+static void pmm_pressure(void) {
+    uint64_t reclaimed = 0;
+
+    zero_pool_drain();
+    mag_flush();
+
+    for (uint32_t i = 0; i < reclaimer_count; i++)
+        reclaimed += reclaimers[i]();
+
+    /* Reclaimed single pages may have landed in the magazine */
+    if (reclaimed)
+        mag_flush();
+}
+
+static uint64_t backend_alloc(size_t pages, uint32_t max_type) {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+    uint64_t pfn =
+        pages > free_pages ? PMM_NO_PAGE : zone_alloc(pages, max_type);
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+    return pfn == PMM_NO_PAGE ? 0 : pfn * PAGE_SIZE;
+}
+
+/*
+ * Allocate from zones of class `zone` or below. The zero pool and magazines
+ * hold pages from any zone, so only unconstrained requests use them.
+ */
+void* palloc_zone(size_t pages, uint32_t zone, uint32_t flags) {
+    if (pages == 0 || zone >= PMM_ZONE_TYPES)
+        return NULL;
+
+    uint64_t addr = 0;
+    bool zero = !(flags & PALLOC_NOZERO);
+    bool cached = zone == PMM_ZONE_NORMAL && pages == 1;
+
+    if (cached && zero) {
+        addr = zero_pool_pop();
+        if (addr) {
+            __atomic_add_fetch(&zero_hits, 1, __ATOMIC_RELAXED);
+            zero = false;
+        }
+    }
+
+    if (!addr && cached)
+        addr = mag_alloc();
+
+    if (!addr) {
+        addr = backend_alloc(pages, zone);
+        if (!addr && !(flags & PALLOC_NORECLAIM)) {
+            pmm_pressure();
+            addr = backend_alloc(pages, zone);
+        }
+        if (!addr)
+            return NULL;
+    }
+
+    if (zero) {
+        __atomic_add_fetch(&zero_misses, 1, __ATOMIC_RELAXED);
+        zero_pages(addr, pages);
+    }
+    return (flags & PALLOC_HIGHER_HALF) ? (void*)(addr + hhdm_offset)
+                                        : (void*)addr;
+}
+
+void* pallocf(size_t pages, uint32_t flags) {
+    return palloc_zone(pages, PMM_ZONE_NORMAL, flags);
+}
+
+void* palloc(size_t pages, bool higher_half) {
+    return pallocf(pages, higher_half ? PALLOC_HIGHER_HALF : 0);
+}
+
+/* Zero one free page into the pool, returns false when there's no work */
+bool pmm_scrub(void) {
+    uint32_t node = current_node();
+    pmm_zero_pool_t* pool = &zero_pools[node];
+
+    if (__atomic_load_n(&pool->count, __ATOMIC_RELAXED) >= PMM_ZERO_POOL_SIZE)
+        return false;
+
+    uint64_t addr = backend_alloc(1, PMM_ZONE_NORMAL);
+    if (!addr)
+        return false;
+
+    /* Only this node's free pages are worth zeroing ahead for it */
+    pmm_zone_t* zone = zone_of(addr / PAGE_SIZE);
+    if (numa_node_count > 1 && (!zone || zone->node != node)) {
+        pfree((void*)addr, 1);
+        return false;
+    }
+
+    zero_pages(addr, 1);
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pool->lock);
+    if (pool->count < PMM_ZERO_POOL_SIZE) {
+        pool->pages[pool->count++] = addr / PAGE_SIZE;
+        __atomic_add_fetch(&zero_scrubbed, 1, __ATOMIC_RELAXED);
+        addr = 0;
+    }
+    spinlock_release(&pool->lock);
+    irq_restore(flags);
+
+    if (addr)
+        pfree((void*)addr, 1); // Lost the race for the last slot
+    return true;
 }
 
 void pfree(void* ptr, size_t pages) {
     if (!ptr || !is_aligned(ptr, MIN_ALIGN))
         return;
 
-    spinlock_acquire(&pmm_lock);
-
     uint64_t start =
         ((uint64_t)ptr - (hhdm_offset * ((uint64_t)ptr >= hhdm_offset))) /
         PAGE_SIZE;
 
-    if (start + pages > bitmap_pages) {
-        spinlock_release(&pmm_lock);
+    if (start + pages > pmm_page_count)
+        return;
+
+    if (pages == 1 && !pmm_backend_is_free(start) && mag_free(start))
         return;
-    }
 
-    for (size_t i = 0; i < pages; i++) {
-        if (bitmap_get(bitmap, start + i)) {
-            bitmap_clear(bitmap, start + i);
-            free_pages++;
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+    zone_free_range(start, pages);
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+}
 
-            if (pages == 1 && cache_index < cache_size) {
-                page_cache[cache_index++] = start;
-            }
-        }
+void pmm_page_get(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    if (pfn < pmm_page_count)
+        __atomic_add_fetch(&page_refs[pfn], 1, __ATOMIC_RELAXED);
+}
+
+bool pmm_page_unref(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    if (pfn >= pmm_page_count)
+        return false;
+
+    uint32_t refs = __atomic_load_n(&page_refs[pfn], __ATOMIC_ACQUIRE);
+    while (refs) {
+        if (__atomic_compare_exchange_n(&page_refs[pfn], &refs, refs - 1,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+            return false;
     }
+    return true;
+}
+
+void pmm_page_put(uint64_t phys) {
+    if (pmm_page_unref(phys))
+        pfree((void*)ALIGN_DOWN(phys, PAGE_SIZE), 1);
+}
 
+uint32_t pmm_page_refs(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    if (pfn >= pmm_page_count)
+        return 0;
+
+    return __atomic_load_n(&page_refs[pfn], __ATOMIC_ACQUIRE) + 1;
+}
+
+/* Free pages in zones of class `type` on all nodes, excluding magazines */
+uint64_t pmm_zone_free(uint32_t type) {
+    uint64_t total = 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+    for (uint32_t i = 0; i < zone_count; i++) {
+        if (zones[i].type == type)
+            total += zones[i].free_pages;
+    }
     spinlock_release(&pmm_lock);
+    irq_restore(flags);
+    return total;
+}
+
+uint64_t pmm_zone_present(uint32_t type) {
+    uint64_t total = 0;
+
+    for (uint32_t i = 0; i < zone_count; i++) {
+        if (zones[i].type == type)
+            total += zones[i].present;
+    }
+    return total;
+}
+
+void pmm_dump(void) {
+    uint64_t cached = 0;
+    uint64_t zeroed = 0;
+
+    for (uint32_t n = 0; n < numa_node_count; n++)
+        zeroed += zero_pools[n].count;
+
+    log("pmm: %llu free pages, %llu pre-zeroed", free_pages, zeroed);
+    log("pmm: zeroed allocs %llu from pool, %llu zeroed inline, %llu scrubbed",
+        zero_hits, zero_misses, zero_scrubbed);
+    for (uint32_t i = 0; i < zone_count; i++) {
+        pmm_zone_t* zone = &zones[i];
+        if (zone->start == zone->end)
+            continue;
+        log("  zone %u (%s): node %u, 0x%.16llx -> 0x%.16llx, %llu/%llu "
+            "free",
+            i, zone_names[zone->type], zone->node, zone->start * PAGE_SIZE,
+            zone->end * PAGE_SIZE, zone->free_pages, zone->present);
+    }
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        pmm_magazine_t* mag = &cpu_locals[i].pmm_mag;
+        uint64_t allocs = mag->alloc_hits + mag->alloc_misses;
+        uint64_t frees = mag->free_hits + mag->free_misses;
+
+        log("  cpu %u (node %u): %u cached, alloc %llu/%llu hits (%llu%%), "
+            "free %llu/%llu hits (%llu%%)",
+            i, cpu_locals[i].numa_node, mag->count, mag->alloc_hits, allocs,
+            allocs ? mag->alloc_hits * 100 / allocs : 0, mag->free_hits, frees,
+            frees ? mag->free_hits * 100 / frees : 0);
+        cached += mag->count;
+    }
+    log("pmm: %llu pages cached in magazines", cached);
 }
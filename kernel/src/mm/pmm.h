@@ -4,12 +4,101 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include <mm/numa.h>
 
 #define PAGE_SIZE 0x1000
 #define PAGE_SIZE_2M (2 * 1024 * 1024)
+#define PAGE_SIZE_1G (1024 * 1024 * 1024ULL)
+
+/* Per-CPU stack of free single pages, lives in cpu_local_t */
+#define PMM_MAG_SIZE 64
+#define PMM_MAG_BATCH 32
+
+typedef struct {
+    uint64_t pages[PMM_MAG_SIZE]; // Page frame numbers
+    uint32_t count;
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t free_hits;
+    uint64_t free_misses;
+} pmm_magazine_t;
+
+/*
+ * A run of page frames the backend manages on its own, tied to one node and
+ * one address class. Zones never straddle the 16 MiB or 4 GiB lines.
+ */
+#define PMM_MAX_ZONES 64
+
+#define PMM_ZONE_DMA 0    // Below 16 MiB, for ISA style DMA
+#define PMM_ZONE_DMA32 1  // Below 4 GiB, for 32-bit devices
+#define PMM_ZONE_NORMAL 2 // Anywhere
+#define PMM_ZONE_TYPES 3
+
+#define PMM_DMA_LIMIT (16ULL * 1024 * 1024)
+#define PMM_DMA32_LIMIT (4ULL * 1024 * 1024 * 1024)
+
+typedef struct pmm_zone {
+    uint32_t id; // Index into backend per-zone state, stable once created
+    uint32_t node;
+    uint32_t type;
+    uint64_t start; // First page frame
+    uint64_t end;   // One past the last page frame
+    uint64_t present;
+    uint64_t free_pages;
+} pmm_zone_t;
+
+/* pallocf() flags */
+#define PALLOC_HIGHER_HALF (1 << 0) // Return an HHDM pointer
+#define PALLOC_NOZERO (1 << 1)      // Caller overwrites the pages anyway
+#define PALLOC_NORECLAIM (1 << 2)   // Fail instead, the caller can do without
 
 void pmm_init();
 void* palloc(size_t pages, bool higher_half);
+void* pallocf(size_t pages, uint32_t flags);
+void* palloc_zone(size_t pages, uint32_t zone, uint32_t flags);
 void pfree(void* ptr, size_t pages);
+bool pmm_scrub(void);
+void pmm_dump(void);
+uint64_t pmm_zone_free(uint32_t zone);
+uint64_t pmm_zone_present(uint32_t zone);
+void pmm_numa_init(const numa_range_t* ranges, uint32_t count);
+
+/*
+ * Page references, for pages mapped in more than one place (copy-on-write).
+ * A page fresh from palloc() holds one, dropping the last frees it. Frames
+ * outside of RAM, like MMIO, aren't counted and pmm_page_refs() says 0 for
+ * them, nobody ever owns them alone. Blocks of pages mapped as one large page
+ * keep the count on their first page and are freed by the caller once
+ * pmm_page_unref() says it let go of the last reference.
+ */
+void pmm_page_get(uint64_t phys);
+void pmm_page_put(uint64_t phys);
+bool pmm_page_unref(uint64_t phys);
+uint32_t pmm_page_refs(uint64_t phys);
+
+/* Called when memory runs out, returns the number of pages it freed */
+#define PMM_MAX_RECLAIMERS 8
+typedef uint64_t (*pmm_reclaim_t)(void);
+
+void pmm_add_reclaimer(pmm_reclaim_t fn);
+
+// Backend, implemented in mm/pmm/*.c. All but init run under the PMM lock
+#define PMM_NO_PAGE UINT64_MAX
+
+extern uint64_t pmm_page_count;
+
+void* pmm_early_alloc(size_t size);
+void pmm_backend_init(uint64_t pages);
+void pmm_backend_zone_init(pmm_zone_t* zone);
+void pmm_backend_add(pmm_zone_t* zone, uint64_t pfn, uint64_t count);
+uint64_t pmm_backend_alloc(pmm_zone_t* zone, size_t pages);
+uint64_t pmm_backend_free(pmm_zone_t* zone, uint64_t pfn, size_t pages);
+void pmm_backend_drain(pmm_zone_t* zone,
+                       void (*fn)(uint64_t pfn, uint64_t count));
+
+/* Lockless peek for pfree(), a stale answer only lets a double free through */
+bool pmm_backend_is_free(uint64_t pfn);
 
 #endif // PMM_H
\ No newline at end of file
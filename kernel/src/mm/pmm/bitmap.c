@@ -0,0 +1,171 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <boot/emk.h>
+#include <lib/bitmap.h>
+#include <lib/string.h>
+#include <mm/pmm.h>
+#include <util/align.h>
+#include <util/log.h>
+
+/*
+ * levels[0] is the page bitmap itself, a set bit is a used page. Each level
+ * above it summarises the one below, with bit n set when word n of the lower
+ * level has a free page somewhere in it. Searches walk down from the top, so
+ * fully used regions are skipped 64^level pages at a time.
+ */
+#define BITMAP_WORD_SIZE (sizeof(uint64_t) * 8)
+#define BITMAP_MAX_LEVELS 6 // 64^6 pages, far past anything we'll boot on
+
+static uint64_t bitmap_pages;
+static uint64_t* levels[BITMAP_MAX_LEVELS];
+static uint64_t level_words[BITMAP_MAX_LEVELS];
+static uint32_t top_level;
+
+/* Free bits of word `w` at `level`, normalising the inverted page bitmap */
+static inline uint64_t free_bits(uint32_t level, uint64_t w) {
+    return level ? levels[level][w] : ~levels[0][w];
+}
+
+static void mark_used(uint64_t pfn) {
+    uint64_t idx = pfn;
+    levels[0][idx / 64] |= 1ULL << (idx % 64);
+    if (levels[0][idx / 64] != UINT64_MAX)
+        return;
+
+    /* The word filled up, clear its bit upwards until a summary stays busy */
+    for (uint32_t l = 1; l <= top_level; l++) {
+        idx /= 64;
+        levels[l][idx / 64] &= ~(1ULL << (idx % 64));
+        if (levels[l][idx / 64] != 0)
+            break;
+    }
+}
+
+static void mark_free(uint64_t pfn) {
+    uint64_t idx = pfn;
+    levels[0][idx / 64] &= ~(1ULL << (idx % 64));
+
+    for (uint32_t l = 1; l <= top_level; l++) {
+        idx /= 64;
+        uint64_t bit = 1ULL << (idx % 64);
+        if (levels[l][idx / 64] & bit)
+            break;
+        levels[l][idx / 64] |= bit;
+    }
+}
+
+/* First free page at or after `pfn`, or PMM_NO_PAGE */
+static uint64_t find_free(uint64_t pfn) {
+    uint64_t idx = pfn;
+    uint32_t level = 0;
+
+    while (true) {
+        uint64_t w = idx / 64;
+        if (w >= level_words[level])
+            return PMM_NO_PAGE;
+
+        uint64_t word = free_bits(level, w) & (UINT64_MAX << (idx % 64));
+        if (word) {
+            idx = w * 64 + __builtin_ctzll(word);
+            while (level > 0) {
+                level--;
+                idx = idx * 64 + __builtin_ctzll(free_bits(level, idx));
+            }
+            return idx < bitmap_pages ? idx : PMM_NO_PAGE;
+        }
+
+        if (level == top_level) {
+            idx = (w + 1) * 64;
+        } else {
+            level++;
+            idx = w + 1;
+        }
+    }
+}
+
+void pmm_backend_init(uint64_t pages) {
+    uint64_t total = 0;
+
+    bitmap_pages = pages;
+    level_words[0] = DIV_ROUND_UP(bitmap_pages, BITMAP_WORD_SIZE);
+    top_level = 0;
+    while (level_words[top_level] > 1 && top_level + 1 < BITMAP_MAX_LEVELS) {
+        level_words[top_level + 1] =
+            DIV_ROUND_UP(level_words[top_level], BITMAP_WORD_SIZE);
+        top_level++;
+    }
+
+    for (uint32_t l = 0; l <= top_level; l++)
+        total += level_words[l] * sizeof(uint64_t);
+
+    uint64_t* mem = pmm_early_alloc(total);
+    for (uint32_t l = 0; l <= top_level; l++) {
+        levels[l] = mem;
+        memset(levels[l], l ? 0x00 : 0xFF, level_words[l] * sizeof(uint64_t));
+        mem += level_words[l];
+    }
+
+    log_early("pmm: bitmap backend, %llu KiB for %llu pages in %u levels",
+              DIV_ROUND_UP(total, 1024), bitmap_pages, top_level + 1);
+}
+
+/* The bitmap is shared by all zones, which just bound the searches */
+void pmm_backend_zone_init(pmm_zone_t* zone) { (void)zone; }
+
+void pmm_backend_add(pmm_zone_t* zone, uint64_t pfn, uint64_t count) {
+    (void)zone;
+    for (uint64_t i = pfn; i < pfn + count && i < bitmap_pages; i++)
+        mark_free(i);
+}
+
+uint64_t pmm_backend_alloc(pmm_zone_t* zone, size_t pages) {
+    uint8_t* bitmap = (uint8_t*)levels[0];
+    uint64_t end = zone->end < bitmap_pages ? zone->end : bitmap_pages;
+    uint64_t pfn = find_free(zone->start);
+
+    /* Grow a run from each free page until it's long enough or hits a used
+     * one, then restart the search past it. Runs may span word boundaries. */
+    while (pfn != PMM_NO_PAGE && pfn + pages <= end) {
+        uint64_t used = bitmap_next_set(bitmap, pfn, pfn + pages);
+        if (used == pfn + pages) {
+            for (uint64_t i = 0; i < pages; i++)
+                mark_used(pfn + i);
+            return pfn;
+        }
+        pfn = find_free(used);
+    }
+
+    return PMM_NO_PAGE;
+}
+
+uint64_t pmm_backend_free(pmm_zone_t* zone, uint64_t pfn, size_t pages) {
+    uint64_t freed = 0;
+
+    (void)zone;
+    for (size_t i = 0; i < pages; i++) {
+        if (bitmap_get((uint8_t*)levels[0], pfn + i)) {
+            mark_free(pfn + i);
+            freed++;
+        }
+    }
+
+    return freed;
+}
+
+bool pmm_backend_is_free(uint64_t pfn) {
+    return !bitmap_get((uint8_t*)levels[0], pfn);
+}
+
+void pmm_backend_drain(pmm_zone_t* zone,
+                       void (*fn)(uint64_t pfn, uint64_t count)) {
+    uint8_t* bitmap = (uint8_t*)levels[0];
+    uint64_t end = zone->end < bitmap_pages ? zone->end : bitmap_pages;
+    uint64_t pfn = find_free(zone->start);
+
+    while (pfn < end) {
+        uint64_t run_end = bitmap_next_set(bitmap, pfn, end);
+        for (uint64_t i = pfn; i < run_end; i++)
+            mark_used(i);
+        fn(pfn, run_end - pfn);
+        pfn = find_free(run_end);
+    }
+}
@@ -0,0 +1,178 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <boot/emk.h>
+#include <lib/string.h>
+#include <mm/pmm.h>
+#include <mm/pmm/buddy.h>
+#include <util/log.h>
+
+/*
+ * Free blocks of 2^order pages sit on per-order doubly linked lists, the
+ * links live in the free pages themselves (through the HHDM). One byte per
+ * page records whether it heads a free block and of which order, which is
+ * all that's needed to find and merge buddies on free. Each zone has its own
+ * lists and blocks never merge across a zone boundary.
+ */
+
+#define BUDDY_FREE (1 << 7)
+
+typedef struct {
+    uint64_t next; // pfn or PMM_NO_PAGE
+    uint64_t prev;
+} buddy_link_t;
+
+static uint8_t* page_state;
+static uint64_t buddy_pages;
+static uint64_t free_heads[PMM_MAX_ZONES][BUDDY_MAX_ORDER + 1];
+static uint32_t nonempty[PMM_MAX_ZONES]; // Bit n set when order n has blocks
+
+static inline buddy_link_t* link_of(uint64_t pfn) {
+    return (buddy_link_t*)HIGHER_HALF(pfn * PAGE_SIZE);
+}
+
+static void list_push(pmm_zone_t* zone, uint64_t pfn, uint32_t order) {
+    uint64_t* heads = free_heads[zone->id];
+    buddy_link_t* link = link_of(pfn);
+    link->next = heads[order];
+    link->prev = PMM_NO_PAGE;
+    if (heads[order] != PMM_NO_PAGE)
+        link_of(heads[order])->prev = pfn;
+    heads[order] = pfn;
+    nonempty[zone->id] |= 1U << order;
+    page_state[pfn] = BUDDY_FREE | order;
+}
+
+static void list_remove(pmm_zone_t* zone, uint64_t pfn, uint32_t order) {
+    uint64_t* heads = free_heads[zone->id];
+    buddy_link_t* link = link_of(pfn);
+    if (link->prev != PMM_NO_PAGE)
+        link_of(link->prev)->next = link->next;
+    else
+        heads[order] = link->next;
+    if (link->next != PMM_NO_PAGE)
+        link_of(link->next)->prev = link->prev;
+    if (heads[order] == PMM_NO_PAGE)
+        nonempty[zone->id] &= ~(1U << order);
+    page_state[pfn] = 0;
+}
+
+static inline uint32_t order_for(size_t pages) {
+    uint32_t order = 0;
+    while ((1ULL << order) < pages)
+        order++;
+    return order;
+}
+
+/* Free one naturally aligned block, merging upwards while the buddy is free */
+static void free_block(pmm_zone_t* zone, uint64_t pfn, uint32_t order) {
+    while (order < BUDDY_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (buddy < zone->start || buddy >= zone->end ||
+            page_state[buddy] != (BUDDY_FREE | order))
+            break;
+        list_remove(zone, buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    list_push(zone, pfn, order);
+}
+
+/* Free an arbitrary range as the largest aligned blocks that fit in it */
+static void free_range(pmm_zone_t* zone, uint64_t pfn, uint64_t count) {
+    uint64_t end = pfn + count;
+
+    while (pfn < end) {
+        uint32_t order = pfn ? __builtin_ctzll(pfn) : BUDDY_MAX_ORDER;
+        if (order > BUDDY_MAX_ORDER)
+            order = BUDDY_MAX_ORDER;
+        while ((1ULL << order) > end - pfn)
+            order--;
+
+        free_block(zone, pfn, order);
+        pfn += 1ULL << order;
+    }
+}
+
+void pmm_backend_init(uint64_t pages) {
+    buddy_pages = pages;
+    page_state = pmm_early_alloc(buddy_pages);
+    memset(page_state, 0, buddy_pages);
+
+    log_early("pmm: buddy backend, max order %d (%llu KiB blocks)",
+              BUDDY_MAX_ORDER, (PAGE_SIZE << BUDDY_MAX_ORDER) / 1024);
+}
+
+void pmm_backend_zone_init(pmm_zone_t* zone) {
+    for (uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++)
+        free_heads[zone->id][i] = PMM_NO_PAGE;
+    nonempty[zone->id] = 0;
+    if (zone->end > buddy_pages)
+        zone->end = buddy_pages;
+}
+
+void pmm_backend_add(pmm_zone_t* zone, uint64_t pfn, uint64_t count) {
+    if (pfn >= zone->end)
+        return;
+    if (pfn + count > zone->end)
+        count = zone->end - pfn;
+    free_range(zone, pfn, count);
+}
+
+uint64_t pmm_backend_alloc(pmm_zone_t* zone, size_t pages) {
+    uint32_t order = order_for(pages);
+    if (order > BUDDY_MAX_ORDER)
+        return PMM_NO_PAGE;
+
+    uint32_t avail = nonempty[zone->id] & ~((1U << order) - 1);
+    if (!avail)
+        return PMM_NO_PAGE;
+
+    uint32_t cur = __builtin_ctz(avail);
+    uint64_t pfn = free_heads[zone->id][cur];
+    list_remove(zone, pfn, cur);
+
+    /* Split down to the requested order, upper halves go back on the lists */
+    while (cur > order) {
+        cur--;
+        list_push(zone, pfn + (1ULL << cur), cur);
+    }
+
+    /* Don't waste the tail of a non power of two request */
+    if ((1ULL << order) > pages)
+        free_range(zone, pfn + pages, (1ULL << order) - pages);
+
+    return pfn;
+}
+
+uint64_t pmm_backend_free(pmm_zone_t* zone, uint64_t pfn, size_t pages) {
+    // A double free may start in the middle of a range or a free block
+    for (size_t i = 0; i < pages; i++) {
+        if (pmm_backend_is_free(pfn + i)) {
+            log("warning: pmm: double free of page 0x%lx", pfn + i);
+            return 0;
+        }
+    }
+
+    free_range(zone, pfn, pages);
+    return pages;
+}
+
+/* Free when it lies inside a free block of some order */
+bool pmm_backend_is_free(uint64_t pfn) {
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        uint64_t head = pfn & ~((1ULL << order) - 1);
+        if (page_state[head] == (BUDDY_FREE | order))
+            return true;
+    }
+    return false;
+}
+
+void pmm_backend_drain(pmm_zone_t* zone,
+                       void (*fn)(uint64_t pfn, uint64_t count)) {
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        while (free_heads[zone->id][order] != PMM_NO_PAGE) {
+            uint64_t pfn = free_heads[zone->id][order];
+            list_remove(zone, pfn, order);
+            fn(pfn, 1ULL << order);
+        }
+    }
+}
@@ -0,0 +1,11 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef BUDDY_H
+#define BUDDY_H
+
+/* Binary buddy physical page allocator */
+
+#ifndef BUDDY_MAX_ORDER
+#define BUDDY_MAX_ORDER 18 // 2^18 pages = 1 GiB
+#endif // BUDDY_MAX_ORDER
+
+#endif // BUDDY_H
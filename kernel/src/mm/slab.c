@@ -0,0 +1,255 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
+#include <boot/emk.h>
+#include <lib/string.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <sys/kpanic.h>
+#include <util/align.h>
+#include <util/log.h>
+
+/*
+ * Each slab is one HHDM page, a slab_t header followed by equally sized
+ * objects, so slab_of() is just a page align. Slabs move between the
+ * partial and full lists of their cache as objects come and go, and the
+ * per-CPU stacks in front of them take the cache lock off the fast path.
+ */
+
+static slab_cache_t* caches = NULL;
+static spinlock_t caches_lock;
+
+static inline void** link_of(slab_cache_t* cache, void* obj) {
+    return (void**)((uint8_t*)obj + cache->link_off);
+}
+
+static void list_push(slab_t** head, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+static void list_remove(slab_t** head, slab_t* slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *head = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+void slab_cache_init(slab_cache_t* cache, const char* name, size_t size,
+                     size_t align, void (*ctor)(void* obj)) {
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+    if (size == 0 || size > SLAB_MAX_SIZE || (align & (align - 1)))
+        kpanic(NULL, "slab: bad cache '%s' (size %llu, align %llu)", name,
+               size, align);
+
+    memset(cache, 0, sizeof(slab_cache_t));
+    cache->name = name;
+    cache->size = size;
+    cache->ctor = ctor;
+
+    /* Without a ctor the link can overwrite the object, it's dead anyway */
+    if (ctor) {
+        cache->link_off = ALIGN_UP(size, sizeof(void*));
+        cache->stride = ALIGN_UP(cache->link_off + sizeof(void*), align);
+    } else {
+        cache->link_off = 0;
+        cache->stride = ALIGN_UP(size, align);
+    }
+    cache->offset = ALIGN_UP(sizeof(slab_t), align);
+    cache->per_slab = (PAGE_SIZE - cache->offset) / cache->stride;
+    if (cache->per_slab < 2)
+        kpanic(NULL, "slab: cache '%s' fits %u objects per slab", name,
+               cache->per_slab);
+
+    spinlock_init(&cache->lock);
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&caches_lock);
+    cache->next = caches;
+    caches = cache;
+    spinlock_release(&caches_lock);
+    irq_restore(flags);
+}
+
+slab_t* slab_of(void* obj) {
+    return (slab_t*)ALIGN_DOWN((uint64_t)obj, PAGE_SIZE);
+}
+
+static slab_t* slab_new(slab_cache_t* cache) {
+    slab_t* slab = pallocf(1, PALLOC_HIGHER_HALF | PALLOC_NOZERO);
+    if (!slab)
+        return NULL;
+
+    memset(slab, 0, sizeof(slab_t));
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+
+    /* Link objects back to front so they come out in address order */
+    uint8_t* base = (uint8_t*)slab + cache->offset;
+    for (uint32_t i = cache->per_slab; i-- > 0;) {
+        void* obj = base + i * cache->stride;
+        if (cache->ctor)
+            cache->ctor(obj);
+        *link_of(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+/* Take one object out of the slabs, cache->lock held */
+static void* obj_take(slab_cache_t* cache) {
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        if (cache->empty) {
+            slab = cache->empty;
+            cache->empty = NULL;
+        } else {
+            slab = slab_new(cache);
+            if (!slab)
+                return NULL;
+        }
+        list_push(&cache->partial, slab);
+    }
+
+    void* obj = slab->free;
+    slab->free = *link_of(cache, obj);
+    if (++slab->inuse == cache->per_slab) {
+        list_remove(&cache->partial, slab);
+        list_push(&cache->full, slab);
+    }
+
+    cache->inuse++;
+    return obj;
+}
+
+/* Return one object to its slab, cache->lock held */
+static void obj_put(slab_cache_t* cache, void* obj) {
+    slab_t* slab = slab_of(obj);
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache)
+        kpanic(NULL, "slab: %p does not belong to cache '%s'", obj,
+               cache->name);
+
+    if (slab->inuse == cache->per_slab) {
+        list_remove(&cache->full, slab);
+        list_push(&cache->partial, slab);
+    }
+
+    *link_of(cache, obj) = slab->free;
+    slab->free = obj;
+    cache->inuse--;
+
+    if (--slab->inuse == 0) {
+        list_remove(&cache->partial, slab);
+        if (cache->empty) {
+            slab->magic = 0;
+            pfree(slab, 1);
+            cache->slabs--;
+        } else {
+            cache->empty = slab;
+        }
+    }
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+    void* obj = NULL;
+
+    uint64_t flags = irq_save();
+    cpu_local_t* cpu = cpu_local_try();
+
+    if (!cpu) {
+        spinlock_acquire(&cache->lock);
+        obj = obj_take(cache);
+        if (obj)
+            cache->allocs++;
+        spinlock_release(&cache->lock);
+        irq_restore(flags);
+        return obj;
+    }
+
+    slab_cpu_t* pc = &cache->cpu[cpu->cpu_index];
+    if (pc->count == 0) {
+        pc->misses++;
+        spinlock_acquire(&cache->lock);
+        while (pc->count < SLAB_CPU_BATCH) {
+            void* o = obj_take(cache);
+            if (!o)
+                break;
+            pc->objs[pc->count++] = o;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    if (pc->count > 0) {
+        obj = pc->objs[--pc->count];
+        pc->allocs++;
+    }
+
+    irq_restore(flags);
+    return obj;
+}
+
+void slab_free(slab_cache_t* cache, void* obj) {
+    if (!obj)
+        return;
+
+    uint64_t flags = irq_save();
+    cpu_local_t* cpu = cpu_local_try();
+
+    if (!cpu) {
+        spinlock_acquire(&cache->lock);
+        obj_put(cache, obj);
+        cache->frees++;
+        spinlock_release(&cache->lock);
+        irq_restore(flags);
+        return;
+    }
+
+    slab_cpu_t* pc = &cache->cpu[cpu->cpu_index];
+    if (pc->count == SLAB_CPU_SIZE) {
+        /* Flush the oldest objects, the recently freed ones are still hot */
+        pc->misses++;
+        spinlock_acquire(&cache->lock);
+        for (uint32_t i = 0; i < SLAB_CPU_BATCH; i++)
+            obj_put(cache, pc->objs[i]);
+        spinlock_release(&cache->lock);
+
+        memmove(pc->objs, pc->objs + SLAB_CPU_BATCH,
+                (SLAB_CPU_SIZE - SLAB_CPU_BATCH) * sizeof(void*));
+        pc->count -= SLAB_CPU_BATCH;
+    }
+
+    pc->objs[pc->count++] = obj;
+    pc->frees++;
+    irq_restore(flags);
+}
+
+void slab_dump(void) {
+    log("slab: %-16s %6s %6s %6s %8s %8s %10s %10s %6s", "cache", "size",
+        "stride", "slabs", "inuse", "cached", "allocs", "frees", "miss%");
+
+    for (slab_cache_t* cache = caches; cache; cache = cache->next) {
+        uint64_t cached = 0, allocs = cache->allocs, frees = cache->frees;
+        uint64_t misses = 0;
+
+        for (uint32_t i = 0; i < cpu_count; i++) {
+            cached += cache->cpu[i].count;
+            allocs += cache->cpu[i].allocs;
+            frees += cache->cpu[i].frees;
+            misses += cache->cpu[i].misses;
+        }
+
+        uint64_t ops = allocs + frees;
+        log("slab: %-16s %6llu %6llu %6llu %8llu %8llu %10llu %10llu %5llu%%",
+            cache->name, cache->size, cache->stride, cache->slabs,
+            cache->inuse - cached, cached, allocs, frees,
+            ops ? misses * 100 / ops : 0);
+    }
+}
@@ -0,0 +1,71 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef SLAB_H
+#define SLAB_H
+
+/* Object caches for fixed size kernel structures */
+
+#include <arch/smp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/spinlock.h>
+
+#define SLAB_MAGIC 0x51AB51AB
+#define SLAB_CPU_SIZE 12 // Objects cached per CPU, keeps slab_cpu_t at 128B
+#define SLAB_CPU_BATCH 6 // Objects moved per refill or flush
+
+typedef struct slab {
+    uint32_t magic;
+    uint32_t inuse;
+    struct slab_cache* cache;
+    struct slab* next;
+    struct slab* prev;
+    void* free; // Free objects in this slab, linked through link_off
+} slab_t;
+
+/* Objects live in single pages after the slab_t header */
+#define SLAB_MAX_SIZE ((PAGE_SIZE - sizeof(slab_t)) / 2)
+
+typedef struct {
+    void* objs[SLAB_CPU_SIZE];
+    uint64_t count;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t misses; // Refills and flushes that had to take the cache lock
+} __attribute__((aligned(64))) slab_cpu_t;
+
+typedef struct slab_cache {
+    const char* name;
+    size_t size;     // Object size as requested
+    size_t stride;   // Distance between objects, including the free link
+    size_t link_off; // Free list link, past the object when there's a ctor
+    size_t offset;   // First object, after the slab_t header
+    uint32_t per_slab;
+    void (*ctor)(void* obj);
+
+    spinlock_t lock;
+    slab_t* partial;
+    slab_t* full;
+    slab_t* empty; // At most one, kept to absorb alloc/free ping-pong
+    slab_cpu_t cpu[MAX_CPUS];
+
+    uint64_t slabs;
+    uint64_t inuse;  // Out of the slabs, including per-CPU cached objects
+    uint64_t allocs; // Before SMP, later ones are counted per CPU
+    uint64_t frees;
+
+    struct slab_cache* next;
+} slab_cache_t;
+
+/*
+ * With a constructor, objects are built once when their slab is created and
+ * must be handed back to slab_free() in constructed state.
+ */
+void slab_cache_init(slab_cache_t* cache, const char* name, size_t size,
+                     size_t align, void (*ctor)(void* obj));
+void* slab_alloc(slab_cache_t* cache);
+void slab_free(slab_cache_t* cache, void* obj);
+slab_t* slab_of(void* obj);
+void slab_dump(void);
+
+#endif // SLAB_H
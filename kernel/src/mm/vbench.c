@@ -0,0 +1,89 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
+#include <arch/paging.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <util/log.h>
+
+/*
+ * Region lookup benchmark, built with CONFIG_VMM_BENCH. Fills a scratch
+ * context with back to back single page regions and times vadd(), vget()
+ * on random addresses and, for comparison, the linear walk of the region
+ * list that vget() used to do. Each run gets a fresh pagemap, vdestroy()
+ * frees it along with its page tables.
+ */
+#define BENCH_BASE 0x100000000ULL
+#define BENCH_LOOKUPS 4096
+#define BENCH_WALKS 64 // The walk is O(n), keep 100k regions bearable
+
+static uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+static uint64_t next_rand(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static vregion_t* list_walk(vctx_t* ctx, uint64_t vaddr) {
+    for (vregion_t* region = ctx->root; region; region = region->next) {
+        if (vaddr >= region->start &&
+            vaddr < region->start + region->pages * PAGE_SIZE)
+            return region;
+    }
+    return NULL;
+}
+
+static void bench(uint64_t count) {
+    uint64_t* pagemap = pmnew();
+    vctx_t* ctx = pagemap ? vinit(pagemap, BENCH_BASE) : NULL;
+    if (!ctx) {
+        log("vbench: failed to create a context");
+        pmfree(pagemap);
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < count; i++) {
+        if (!vadd(ctx, BENCH_BASE + i * PAGE_SIZE, 0, 1, VALLOC_RW)) {
+            log("vbench: vadd failed after %llu regions", i);
+            vdestroy(ctx);
+            return;
+        }
+    }
+    uint64_t add = (rdtsc() - start) / count;
+
+    uint64_t misses = 0;
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_LOOKUPS; i++) {
+        uint64_t vaddr = BENCH_BASE + next_rand() % (count * PAGE_SIZE);
+        misses += vget(ctx, vaddr) == NULL;
+    }
+    uint64_t get = (rdtsc() - start) / BENCH_LOOKUPS;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_WALKS; i++) {
+        uint64_t vaddr = BENCH_BASE + next_rand() % (count * PAGE_SIZE);
+        misses += list_walk(ctx, vaddr) == NULL;
+    }
+    uint64_t walk = (rdtsc() - start) / BENCH_WALKS;
+
+    log("vbench: %6llu regions: vadd %6llu, vget %6llu, list walk %9llu "
+        "cycles/op",
+        count, add, get, walk);
+    if (misses)
+        log("warning: vbench: %llu lookups missed", misses);
+
+    vdestroy(ctx);
+}
+
+void vbench(void) {
+    uint64_t tables = pmtables();
+
+    bench(10);
+    bench(1000);
+    bench(100000);
+
+    if (pmtables() != tables)
+        log("warning: vbench: %llu page tables leaked", pmtables() - tables);
+}
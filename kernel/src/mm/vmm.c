@@ -3,200 +3,384 @@
 #include <boot/emk.h>
 #include <lib/string.h>
 #include <mm/pmm.h>
+#include <mm/slab.h>
 #include <mm/vmm.h>
 #include <util/align.h>
 #include <util/log.h>
 
+#define LARGE_PAGES_PER (PAGE_SIZE_2M / PAGE_SIZE)
+
+static slab_cache_t vctx_cache;
+static slab_cache_t vregion_cache;
+static uint64_t next_ctx_id = 1;
+
+void vmm_init(void) {
+    slab_cache_init(&vctx_cache, "vctx_t", sizeof(vctx_t), 8, NULL);
+    slab_cache_init(&vregion_cache, "vregion_t", sizeof(vregion_t), 8, NULL);
+}
+
+static inline uint64_t region_end(vregion_t* region) {
+    return region->start + region->pages * PAGE_SIZE;
+}
+
+static inline vregion_t* region_of(rb_node_t* node) {
+    return node ? rb_entry(node, vregion_t, node) : NULL;
+}
+
+static void region_augment(rb_node_t* node) {
+    vregion_t* region = region_of(node);
+    uint64_t max = region->gap;
+
+    if (node->left && region_of(node->left)->max_gap > max)
+        max = region_of(node->left)->max_gap;
+    if (node->right && region_of(node->right)->max_gap > max)
+        max = region_of(node->right)->max_gap;
+    region->max_gap = max;
+}
+
+/* Space between the previous region (or ctx->start) and this one */
+static void region_set_gap(vctx_t* ctx, vregion_t* region) {
+    uint64_t floor = ctx->start;
+    if (region->prev && region_end(region->prev) > floor)
+        floor = region_end(region->prev);
+
+    region->gap = region->start > floor ? region->start - floor : 0;
+}
+
+/* Region with the highest start at or below vaddr */
+static vregion_t* region_floor(vctx_t* ctx, uint64_t vaddr) {
+    rb_node_t* node = ctx->tree.root;
+    vregion_t* best = NULL;
+
+    while (node) {
+        vregion_t* region = region_of(node);
+        if (region->start <= vaddr) {
+            best = region;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return best;
+}
+
+/*
+ * Lowest address at or above ctx->start with size bytes free after it, or 0
+ * if there's no room before ctx->end
+ */
+static uint64_t region_find_gap(vctx_t* ctx, uint64_t size) {
+    rb_node_t* node = ctx->tree.root;
+
+    if (node && region_of(node)->max_gap >= size) {
+        while (true) {
+            if (node->left && region_of(node->left)->max_gap >= size) {
+                node = node->left;
+                continue;
+            }
+
+            vregion_t* region = region_of(node);
+            if (region->gap >= size)
+                return region->start - region->gap;
+            node = node->right; // The fit has to be on this side
+        }
+    }
+
+    uint64_t base = ctx->start;
+    vregion_t* last = region_of(rb_last(&ctx->tree));
+    if (last && region_end(last) > base)
+        base = region_end(last);
+
+    if (base > ctx->end || ctx->end - base < size)
+        return 0;
+    return base;
+}
+
+/* Only the last region starting below the end can reach into the range */
+static bool region_overlaps(vctx_t* ctx, uint64_t vaddr, size_t pages) {
+    vregion_t* region = region_floor(ctx, vaddr + pages * PAGE_SIZE - 1);
+    return region && region_end(region) > vaddr;
+}
+
+/* Link a new region into the list and tree, it must not overlap another */
+static void region_insert(vctx_t* ctx, vregion_t* new) {
+    rb_node_t** link = &ctx->tree.root;
+    rb_node_t* parent = NULL;
+    vregion_t* prev = NULL;
+    vregion_t* next = NULL;
+
+    while (*link) {
+        parent = *link;
+        if (new->start < region_of(parent)->start) {
+            next = region_of(parent);
+            link = &parent->left;
+        } else {
+            prev = region_of(parent);
+            link = &parent->right;
+        }
+    }
+
+    new->prev = prev;
+    new->next = next;
+    if (prev)
+        prev->next = new;
+    else
+        ctx->root = new;
+    if (next)
+        next->prev = new;
+
+    region_set_gap(ctx, new);
+    rb_insert(&ctx->tree, &new->node, parent, link);
+
+    if (next) {
+        region_set_gap(ctx, next);
+        rb_propagate(&ctx->tree, &next->node);
+    }
+}
+
+static void region_remove(vctx_t* ctx, vregion_t* region) {
+    vregion_t* prev = region->prev;
+    vregion_t* next = region->next;
+
+    if (prev)
+        prev->next = next;
+    else
+        ctx->root = next;
+    if (next)
+        next->prev = prev;
+
+    rb_erase(&ctx->tree, &region->node);
+
+    if (next) {
+        region_set_gap(ctx, next);
+        rb_propagate(&ctx->tree, &next->node);
+    }
+}
+
+static vregion_t* region_new(vctx_t* ctx, uint64_t start, size_t pages,
+                             uint64_t flags) {
+    vregion_t* new = (vregion_t*)slab_alloc(&vregion_cache);
+    if (!new)
+        return NULL;
+
+    memset(new, 0, sizeof(vregion_t));
+    new->start = start;
+    new->pages = pages;
+    new->flags = VFLAGS_TO_PFLAGS(flags);
+    new->vflags = flags;
+    region_insert(ctx, new);
+    return new;
+}
+
 vctx_t* vinit(uint64_t* pm, uint64_t start) {
-    vctx_t* ctx = (vctx_t*)palloc(1, true);
+    vctx_t* ctx = (vctx_t*)slab_alloc(&vctx_cache);
     if (!ctx)
         return NULL;
-    memset(ctx, 0, sizeof(vctx_t));
-    ctx->root = (vregion_t*)palloc(1, true);
-    if (!ctx->root) {
-        pfree(ctx, 1);
-        return NULL;
-    }
 
+    memset(ctx, 0, sizeof(vctx_t));
+    ctx->tree.augment = region_augment;
+    ctx->id = __atomic_fetch_add(&next_ctx_id, 1, __ATOMIC_RELAXED);
     ctx->pagemap = pm;
-    ctx->root->start = start;
-    ctx->root->pages = 0;
+    ctx->start = start;
+    ctx->end = start < VPM_USER_END ? VPM_USER_END : VPM_KERNEL_END;
     return ctx;
 }
 
+/*
+ * Tear ctx down: every region and the pages behind it, then the pagemap it
+ * was given in vinit(), unless that's the kernel's.
+ */
 void vdestroy(vctx_t* ctx) {
-    if (ctx->root == NULL || ctx->pagemap == NULL)
+    if (ctx == NULL || ctx->pagemap == NULL)
         return;
 
-    vregion_t* region = ctx->root;
-    while (region != NULL) {
-        vregion_t* next = region->next;
-        pfree(region, 1);
-        region = next;
+    if (ctx == kvm_ctx) {
+        log("warning: vdestroy: refusing to destroy the kernel context");
+        return;
     }
-    pfree(ctx, 1);
+
+    while (ctx->root)
+        vfree(ctx, (void*)ctx->root->start);
+    pmfree(ctx->pagemap);
+    slab_free(&vctx_cache, ctx);
 }
 
-void* valloc(vctx_t* ctx, size_t pages, uint64_t flags) {
-    if (ctx == NULL || ctx->root == NULL || ctx->pagemap == NULL)
-        return NULL;
+/* 2M of zeroed, contiguous and aligned memory, 0 if there's none to spare */
+static uint64_t large_alloc(void) {
+    uint64_t phys = (uint64_t)pallocf(LARGE_PAGES_PER, PALLOC_NORECLAIM);
+    if (phys & (PAGE_SIZE_2M - 1)) {
+        pfree((void*)phys, LARGE_PAGES_PER); // Not every backend aligns
+        return 0;
+    }
+    return phys;
+}
 
-    vregion_t* region = ctx->root;
-    vregion_t* new = NULL;
-    vregion_t* last = ctx->root;
+/*
+ * Back the 2M at virt with a single large page, if the CPU has them, the
+ * region covers all of it and the memory is there. Fresh regions have
+ * nothing mapped yet, others need checking.
+ */
+static bool region_map_large(vctx_t* ctx, vregion_t* region, uint64_t virt,
+                             bool fresh) {
+    if (!_supports_large_pages() || (virt & (PAGE_SIZE_2M - 1)) ||
+        virt < region->start || virt + PAGE_SIZE_2M > region_end(region))
+        return false;
+
+    uint64_t* pte = vpte(ctx->pagemap, virt);
+    for (uint64_t i = 0; !fresh && pte && i < LARGE_PAGES_PER; i++) {
+        if (pte[i] & VMM_PRESENT)
+            return false;
+    }
 
-    while (region) {
-        if (region->next == NULL ||
-            region->start + (region->pages * PAGE_SIZE) < region->next->start) {
-            new = (vregion_t*)palloc(1, true);
-            if (!new)
-                return NULL;
-
-            memset(new, 0, sizeof(vregion_t));
-            new->pages = pages;
-            new->flags = VFLAGS_TO_PFLAGS(flags);
-            new->start = region->start + (region->pages * PAGE_SIZE);
-            new->next = region->next;
-            new->prev = region;
-            region->next = new;
-            for (uint64_t i = 0; i < pages; i++) {
-                uint64_t page = (uint64_t)palloc(1, false);
-                if (page == 0)
-                    return NULL;
-
-                vmap(ctx->pagemap, new->start + (i * PAGE_SIZE), page,
-                     new->flags);
-            }
-            return (void*)new->start;
+    uint64_t phys = large_alloc();
+    if (phys == 0)
+        return false;
+
+    if (vmap_large(ctx->pagemap, virt, phys, region->flags)) {
+        pfree((void*)phys, LARGE_PAGES_PER);
+        return false;
+    }
+
+    region->large_pages++;
+    return true;
+}
+
+/* Map contiguous physical memory, as 2M pages where both sides line up */
+static void region_map(vctx_t* ctx, vregion_t* region, uint64_t paddr) {
+    uint64_t virt = region->start;
+    uint64_t end = region_end(region);
+
+    while (virt < end) {
+        uint64_t next = ALIGN_UP(virt + 1, PAGE_SIZE_2M);
+        if (next > end)
+            next = end;
+
+        if (_supports_large_pages() && !(virt & (PAGE_SIZE_2M - 1)) &&
+            !(paddr & (PAGE_SIZE_2M - 1)) && next - virt == PAGE_SIZE_2M &&
+            !vmap_large(ctx->pagemap, virt, paddr, region->flags)) {
+            region->large_pages++;
+        } else {
+            vmap_range(ctx->pagemap, virt, paddr, (next - virt) / PAGE_SIZE,
+                       region->flags);
         }
-        region = region->next;
+
+        paddr += next - virt;
+        virt = next;
     }
+}
+
+/*
+ * Map pages that belong to someone else, 4K at a time so each gets a
+ * reference of its own and outlives the region as long as the owner keeps
+ * its. Writable ones go in copy-on-write, writes never reach the originals.
+ */
+static void region_map_shared(vctx_t* ctx, vregion_t* region,
+                              uint64_t paddr) {
+    uint64_t flags = region->flags;
+    if (flags & VMM_WRITE)
+        flags = (flags & ~VMM_WRITE) | VMM_COW;
+
+    for (uint64_t i = 0; i < region->pages; i++)
+        pmm_page_get(paddr + i * PAGE_SIZE);
+    vmap_range(ctx->pagemap, region->start, paddr, region->pages, flags);
+}
 
-    new = (vregion_t*)palloc(1, true);
+/* Back a new region at vaddr with fresh pages, unless it's lazy */
+static void* region_populate(vctx_t* ctx, uint64_t vaddr, size_t pages,
+                             uint64_t flags) {
+    vregion_t* new = region_new(ctx, vaddr, pages, flags);
     if (!new)
         return NULL;
 
-    memset(new, 0, sizeof(vregion_t));
-    last->next = new;
-    new->prev = last;
-    new->start = last->start + (last->pages * PAGE_SIZE);
-    new->pages = pages;
-    new->flags = VFLAGS_TO_PFLAGS(flags);
-    new->next = NULL;
+    if (flags & VALLOC_LAZY)
+        return (void*)new->start;
+
+    for (uint64_t i = 0; i < pages;) {
+        uint64_t virt = new->start + (i * PAGE_SIZE);
+        if (region_map_large(ctx, new, virt, true)) {
+            i += LARGE_PAGES_PER;
+            continue;
+        }
 
-    for (uint64_t i = 0; i < pages; i++) {
         uint64_t page = (uint64_t)palloc(1, false);
         if (page == 0)
             return NULL;
 
-        vmap(ctx->pagemap, new->start + (i * PAGE_SIZE), page, new->flags);
+        vmap(ctx->pagemap, virt, page, new->flags);
+        i++;
     }
     return (void*)new->start;
 }
 
-void* vallocat(vctx_t* ctx, size_t pages, uint64_t flags, uint64_t phys) {
-    if (ctx == NULL || ctx->root == NULL || ctx->pagemap == NULL)
+void* valloc(vctx_t* ctx, size_t pages, uint64_t flags) {
+    if (ctx == NULL || ctx->pagemap == NULL)
         return NULL;
 
-    vregion_t* region = ctx->root;
-    vregion_t* new = NULL;
-    vregion_t* last = ctx->root;
+    /* Start big regions on a 2M boundary so large pages can back them */
+    uint64_t size = pages * PAGE_SIZE;
+    uint64_t vaddr;
+    if (_supports_large_pages() && size >= PAGE_SIZE_2M)
+        vaddr = ALIGN_UP(region_find_gap(ctx, size + PAGE_SIZE_2M - PAGE_SIZE),
+                         PAGE_SIZE_2M);
+    else
+        vaddr = region_find_gap(ctx, size);
 
-    phys = ALIGN_DOWN(phys, PAGE_SIZE);
+    if (!vaddr || vaddr + size > ctx->end)
+        return NULL;
+    return region_populate(ctx, vaddr, pages, flags);
+}
 
-    while (region) {
-        if (region->next == NULL ||
-            region->start + (pages * PAGE_SIZE) < region->next->start) {
-            new = (vregion_t*)palloc(1, true);
-            if (!new)
-                return NULL;
-
-            memset(new, 0, sizeof(vregion_t));
-            new->pages = pages;
-            new->flags = VFLAGS_TO_PFLAGS(flags);
-            new->start = region->start + (region->pages * PAGE_SIZE);
-            new->next = region->next;
-            new->prev = region;
-            region->next = new;
-            for (uint64_t i = 0; i < pages; i++) {
-                uint64_t page = phys + (i * PAGE_SIZE);
-                if (page == 0)
-                    return NULL;
-
-                vmap(ctx->pagemap, new->start + (i * PAGE_SIZE), page,
-                     new->flags);
-            }
-            return (void*)new->start;
-        }
-        region = region->next;
-    }
+/* valloc() at a fixed, page aligned address, fails on overlap */
+void* vallocfixed(vctx_t* ctx, uint64_t vaddr, size_t pages, uint64_t flags) {
+    if (ctx == NULL || ctx->pagemap == NULL || (vaddr & (PAGE_SIZE - 1)))
+        return NULL;
 
-    new = (vregion_t*)palloc(1, true);
-    if (!new)
+    if (region_overlaps(ctx, vaddr, pages))
         return NULL;
 
-    memset(new, 0, sizeof(vregion_t));
-    last->next = new;
-    new->prev = last;
-    new->start = last->start + (last->pages * PAGE_SIZE);
-    new->pages = pages;
-    new->flags = VFLAGS_TO_PFLAGS(flags);
-    new->next = NULL;
+    return region_populate(ctx, vaddr, pages, flags);
+}
 
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t page = phys + (i * PAGE_SIZE);
-        if (page == 0)
-            return NULL;
+void* vallocat(vctx_t* ctx, size_t pages, uint64_t flags, uint64_t phys) {
+    if (ctx == NULL || ctx->pagemap == NULL)
+        return NULL;
 
-        vmap(ctx->pagemap, new->start + (i * PAGE_SIZE), page, new->flags);
-    }
+    phys = ALIGN_DOWN(phys, PAGE_SIZE);
+    if (phys == 0)
+        return NULL;
+
+    uint64_t vaddr = region_find_gap(ctx, pages * PAGE_SIZE);
+    if (!vaddr)
+        return NULL;
+
+    vregion_t* new = region_new(ctx, vaddr, pages, flags);
+    if (!new)
+        return NULL;
+
+    region_map(ctx, new, phys);
     return (void*)new->start;
 }
 
 void* vadd(vctx_t* ctx, uint64_t vaddr, uint64_t paddr, size_t pages,
            uint64_t flags) {
-    if (ctx == NULL || ctx->root == NULL || ctx->pagemap == NULL)
+    if (ctx == NULL || ctx->pagemap == NULL)
         return NULL;
 
     vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
     paddr = ALIGN_DOWN(paddr, PAGE_SIZE);
 
-    uint64_t vend = vaddr + pages * PAGE_SIZE;
-
-    vregion_t* region = ctx->root;
-    while (region) {
-        uint64_t rstart = region->start;
-        uint64_t rend = region->start + region->pages * PAGE_SIZE;
-
-        if ((vaddr >= rstart && vaddr < rend) ||
-            (vend > rstart && vend <= rend) ||
-            (vaddr <= rstart && vend >= rend)) {
-            log("warning: vadd: overlapping region at 0x%lx", vaddr);
-            return NULL;
-        }
-        region = region->next;
+    if (region_overlaps(ctx, vaddr, pages)) {
+        log("warning: vadd: overlapping region at 0x%lx", vaddr);
+        return NULL;
     }
 
-    vregion_t* new = (vregion_t*)palloc(1, true);
+    vregion_t* new = region_new(ctx, vaddr, pages, flags);
     if (!new)
         return NULL;
 
-    memset(new, 0, sizeof(vregion_t));
-    new->start = vaddr;
-    new->pages = pages;
-    new->flags = VFLAGS_TO_PFLAGS(flags);
-
-    new->next = ctx->root;
-    if (ctx->root)
-        ctx->root->prev = new;
-    ctx->root = new;
-
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t vpage = vaddr + (i * PAGE_SIZE);
-        uint64_t ppage = paddr + (i * PAGE_SIZE);
-        vmap(ctx->pagemap, vpage, ppage, new->flags);
-    }
-
+    if (flags & VALLOC_SHARED)
+        region_map_shared(ctx, new, paddr);
+    else
+        region_map(ctx, new, paddr);
     return (void*)vaddr;
 }
 
@@ -204,58 +388,202 @@ void vfree(vctx_t* ctx, void* ptr) {
     if (ctx == NULL)
         return;
 
-    vregion_t* region = ctx->root;
-    while (region != NULL) {
-        if (region->start == (uint64_t)ptr) {
-            break;
+    vregion_t* region = region_floor(ctx, (uint64_t)ptr);
+    if (region == NULL || region->start != (uint64_t)ptr)
+        return;
+
+    for (uint64_t virt = region->start; virt < region_end(region);) {
+        uint64_t* pte = vpte(ctx->pagemap, virt);
+        if (pte && (*pte & VMM_LARGE)) {
+            if (pmm_page_unref(*pte & PAGE_MASK))
+                pfree((void*)(*pte & PAGE_MASK), LARGE_PAGES_PER);
+            virt += PAGE_SIZE_2M;
+            continue;
         }
-        region = region->next;
+
+        if (pte && (*pte & VMM_PRESENT))
+            pmm_page_put(*pte & PAGE_MASK);
+        virt += PAGE_SIZE;
     }
+    vunmap_range(ctx->pagemap, region->start, region->pages);
 
-    if (region == NULL)
-        return;
+    region_remove(ctx, region);
+    slab_free(&vregion_cache, region);
+}
 
-    vregion_t* prev = region->prev;
-    vregion_t* next = region->next;
+vregion_t* vget(vctx_t* ctx, uint64_t vaddr) {
+    if (ctx == NULL)
+        return NULL;
 
-    for (uint64_t i = 0; i < region->pages; i++) {
-        uint64_t virt = region->start + (i * PAGE_SIZE);
-        uint64_t phys = virt_to_phys(kernel_pagemap, virt);
+    vregion_t* region = region_floor(ctx, vaddr);
+    if (region && vaddr < region_end(region))
+        return region;
 
-        if (phys != 0) {
-            pfree((void*)phys, 1);
-            vunmap(ctx->pagemap, virt);
+    return NULL;
+}
+
+/* Share the present pages of region with copy, see vclone() */
+static bool region_share(vctx_t* ctx, vctx_t* new, vregion_t* region) {
+    for (uint64_t virt = region->start; virt < region_end(region);) {
+        uint64_t* pte = vpte(ctx->pagemap, virt);
+        if (!pte || !(*pte & VMM_PRESENT)) {
+            virt += PAGE_SIZE;
+            continue;
         }
+
+        bool large = *pte & VMM_LARGE;
+        int (*map)(uint64_t*, uint64_t, uint64_t, uint64_t) =
+            large ? vmap_large : vmap;
+        uint64_t phys = *pte & PAGE_MASK;
+        uint64_t flags = *pte & ~PAGE_MASK & ~VMM_LARGE;
+        if (flags & VMM_WRITE) {
+            flags = (flags & ~VMM_WRITE) | VMM_COW;
+            map(ctx->pagemap, virt, phys, flags);
+        }
+
+        pmm_page_get(phys);
+        if (map(new->pagemap, virt, phys, flags)) {
+            pmm_page_put(phys);
+            return false;
+        }
+        virt += large ? PAGE_SIZE_2M : PAGE_SIZE;
     }
+    return true;
+}
 
-    if (prev != NULL)
-        prev->next = next;
+/*
+ * Copy ctx into a new context on pagemap. Nothing is copied up front, both
+ * sides map the same pages and writable ones are made read-only and marked
+ * VMM_COW in both, so the first write to one faults and vfault() gives the
+ * writer its own copy. pagemap belongs to the new context, and is freed with
+ * it if the copy fails.
+ */
+vctx_t* vclone(vctx_t* ctx, uint64_t* pagemap) {
+    if (ctx == NULL || ctx->pagemap == NULL || pagemap == NULL)
+        return NULL;
 
-    if (next != NULL)
-        next->prev = prev;
+    vctx_t* new = vinit(pagemap, ctx->start);
+    if (!new)
+        return NULL;
 
-    if (region == ctx->root)
-        ctx->root = next;
+    for (vregion_t* region = ctx->root; region; region = region->next) {
+        vregion_t* copy =
+            region_new(new, region->start, region->pages, region->vflags);
+        if (copy) {
+            copy->flags = region->flags;
+            copy->large_pages = region->large_pages;
+        }
 
-    pfree(region, 1);
+        if (!copy || !region_share(ctx, new, region)) {
+            vdestroy(new);
+            return NULL;
+        }
+    }
+
+    return new;
 }
 
-vregion_t* vget(vctx_t* ctx, uint64_t vaddr) {
-    if (ctx == NULL || ctx->root == NULL)
-        return NULL;
+/* Give the faulting side its own writable copy of a VMM_COW page */
+static bool cow_break(vctx_t* ctx, vregion_t* region, uint64_t virt,
+                      uint64_t* pte) {
+    uint64_t old = *pte & PAGE_MASK;
 
-    vregion_t* region = ctx->root;
-    while (region != NULL) {
-        uint64_t start = region->start;
-        uint64_t end = start + (region->pages * PAGE_SIZE);
+    /* Everyone else let go of it already, just take it back */
+    if (pmm_page_refs(old) == 1)
+        return vmap(ctx->pagemap, virt, old, region->flags) == 0;
 
-        if (vaddr >= start && vaddr < end)
-            return region;
+    uint64_t page = (uint64_t)pallocf(1, PALLOC_NOZERO);
+    if (page == 0)
+        return false;
 
-        region = region->next;
+    memcpy((void*)HIGHER_HALF(page), (void*)HIGHER_HALF(old), PAGE_SIZE);
+    if (vmap(ctx->pagemap, virt, page, region->flags)) {
+        pfree((void*)page, 1);
+        return false;
     }
 
-    return NULL;
+    pmm_page_put(old);
+    return true;
+}
+
+/* Same for a 2M page, falling back to copying it a 4K page at a time */
+static bool cow_break_large(vctx_t* ctx, vregion_t* region, uint64_t virt,
+                            uint64_t* pte) {
+    uint64_t old = *pte & PAGE_MASK;
+    virt = ALIGN_DOWN(virt, PAGE_SIZE_2M);
+
+    if (pmm_page_refs(old) == 1)
+        return vmap_large(ctx->pagemap, virt, old, region->flags) == 0;
+
+    uint64_t block = large_alloc();
+    if (block) {
+        memcpy((void*)HIGHER_HALF(block), (void*)HIGHER_HALF(old),
+               PAGE_SIZE_2M);
+        if (vmap_large(ctx->pagemap, virt, block, region->flags)) {
+            pfree((void*)block, LARGE_PAGES_PER);
+            return false;
+        }
+    } else {
+        for (uint64_t i = 0; i < LARGE_PAGES_PER; i++) {
+            uint64_t page = (uint64_t)pallocf(1, PALLOC_NOZERO);
+            if (page == 0)
+                return false;
+
+            memcpy((void*)HIGHER_HALF(page),
+                   (void*)HIGHER_HALF(old + i * PAGE_SIZE), PAGE_SIZE);
+            if (vmap(ctx->pagemap, virt + i * PAGE_SIZE, page, region->flags)) {
+                pfree((void*)page, 1);
+                return false;
+            }
+        }
+        region->large_pages--;
+    }
+
+    if (pmm_page_unref(old))
+        pfree((void*)old, LARGE_PAGES_PER);
+    return true;
+}
+
+/*
+ * Called on a page fault in ctx. Backs the page if it's the first touch of
+ * a lazy region or the first write to a copy-on-write page and the access
+ * is allowed, returns false if the fault is a real one.
+ */
+bool vfault(vctx_t* ctx, uint64_t vaddr, uint64_t err) {
+    vregion_t* region = vget(ctx, vaddr);
+    if (!region)
+        return false;
+
+    if ((err & VFAULT_WRITE) && !(region->flags & VMM_WRITE))
+        return false;
+    if ((err & VFAULT_USER) && !(region->flags & VMM_USER))
+        return false;
+
+    uint64_t virt = ALIGN_DOWN(vaddr, PAGE_SIZE);
+    if (err & VFAULT_PRESENT) {
+        uint64_t* pte = vpte(ctx->pagemap, virt);
+        if (!(err & VFAULT_WRITE) || !pte || !(*pte & VMM_COW))
+            return false;
+        if (*pte & VMM_LARGE)
+            return cow_break_large(ctx, region, virt, pte);
+        return cow_break(ctx, region, virt, pte);
+    }
+
+    if (!(region->vflags & VALLOC_LAZY))
+        return false;
+
+    if (region_map_large(ctx, region, ALIGN_DOWN(virt, PAGE_SIZE_2M), false))
+        return true;
+
+    uint64_t page = (uint64_t)palloc(1, false);
+    if (page == 0)
+        return false;
+
+    if (vmap(ctx->pagemap, virt, page, region->flags)) {
+        pfree((void*)page, 1);
+        return false;
+    }
+    return true;
 }
 
 const char* vflags_to_str(uint64_t flags) {
@@ -270,6 +598,10 @@ const char* vflags_to_str(uint64_t flags) {
         out[i++] = 'X';
     if (flags & VALLOC_USER)
         out[i++] = 'U';
+    if (flags & VALLOC_LAZY)
+        out[i++] = 'L';
+    if (flags & VALLOC_SHARED)
+        out[i++] = 'S';
     if (i == 0)
         out[i++] = '-';
 
@@ -302,12 +634,13 @@ void vdump(vctx_t* ctx) {
         return;
     }
 
-    log("vdump for context at %p", ctx);
+    log("vdump for context at %p, %llu page tables in use", ctx, pmtables());
     vregion_t* region = ctx->root;
     while (region) {
-        log("  region %p: start=0x%.16lx, pages=%lu, flags=0x%lx \t(%s)",
-            region, region->start, region->pages, region->flags,
-            vpflags_to_str(region->flags));
+        log("  region %p: start=0x%.16lx, pages=%lu (%lu 2M), flags=0x%lx "
+            "\t(%s)",
+            region, region->start, region->pages, region->large_pages,
+            region->flags, vpflags_to_str(region->flags));
         region = region->next;
     }
 }
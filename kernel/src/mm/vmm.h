@@ -2,6 +2,8 @@
 #ifndef VMM_H
 #define VMM_H
 
+#include <lib/rbtree.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -9,40 +11,72 @@
 #define VPM_MIN_ADDR 0x1000
 #endif // VPM_MIN_ADDR
 
+#define VPM_USER_END 0x0000800000000000ULL // End of the lower half
+#define VPM_KERNEL_START 0xFFFFC00000000000ULL // kvm_ctx, above the HHDM
+#define VPM_KERNEL_END 0xFFFFFFFF80000000ULL   // The kernel image
+
 #define VALLOC_NONE 0x0
 #define VALLOC_READ (1 << 0)
 #define VALLOC_WRITE (1 << 1)
 #define VALLOC_EXEC (1 << 2)
 #define VALLOC_USER (1 << 3)
+#define VALLOC_LAZY (1 << 4) // Reserve only, pages are backed by vfault()
+#define VALLOC_SHARED (1 << 5) // vadd() only, the pages stay the caller's
 
 #define VALLOC_RW (VALLOC_READ | VALLOC_WRITE)
 #define VALLOC_RX (VALLOC_READ | VALLOC_EXEC)
 #define VALLOC_RWX (VALLOC_READ | VALLOC_WRITE | VALLOC_EXEC)
 
+/* Page fault error code bits, as passed to vfault() */
+#define VFAULT_PRESENT (1 << 0)
+#define VFAULT_WRITE (1 << 1)
+#define VFAULT_USER (1 << 2)
+
 typedef struct vregion {
     uint64_t start;
     uint64_t pages;
-    uint64_t flags;
+    uint64_t flags;       // Page flags
+    uint64_t vflags;      // VALLOC_* as requested
+    uint64_t large_pages; // How many 2M pages back it
     struct vregion* next;
     struct vregion* prev;
+    rb_node_t node;
+    uint64_t gap;     // Free bytes before this region, above ctx->start
+    uint64_t max_gap; // Largest gap in this region's subtree
 } vregion_t;
 
+/*
+ * Regions are kept both in a list sorted by address, for walking them in
+ * order, and in a tree keyed on start for lookups and finding free space.
+ */
 typedef struct vctx {
-    vregion_t* root;
+    vregion_t* root; // Lowest region, head of the list
+    rb_tree_t tree;
+    uint64_t id; // Never reused, tags the context's PCID
     uint64_t* pagemap;
-    uint64_t start;
+    uint64_t start; // valloc() never hands out anything below this
+    uint64_t end;   // ...or past this, the end of start's half
 } vctx_t;
 
+void vmm_init(void);
 vctx_t* vinit(uint64_t* pm, uint64_t start);
 void vdestroy(vctx_t* ctx);
 void* valloc(vctx_t* ctx, size_t pages, uint64_t flags);
 void* vallocat(vctx_t* ctx, size_t pages, uint64_t flags, uint64_t phys);
+void* vallocfixed(vctx_t* ctx, uint64_t vaddr, size_t pages, uint64_t flags);
 void* vadd(vctx_t* ctx, uint64_t vaddr, uint64_t paddr, size_t pages,
            uint64_t flags);
 void vfree(vctx_t* ctx, void* ptr);
+vctx_t* vclone(vctx_t* ctx, uint64_t* pagemap);
 vregion_t* vget(vctx_t* ctx, uint64_t vaddr);
+bool vfault(vctx_t* ctx, uint64_t vaddr, uint64_t err);
 void vdump(vctx_t* ctx);
 const char* vpflags_to_str(uint64_t flags);
 const char* vflags_to_str(uint64_t flags);
 
+/* Region lookup benchmark, see mm/vbench.c */
+#if VMM_BENCH
+void vbench(void);
+#endif // VMM_BENCH
+
 #endif // VMM_H
\ No newline at end of file
@@ -0,0 +1,86 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <sys/acpi.h>
+#include <sys/acpi/srat.h>
+#include <util/log.h>
+
+acpi_srat_lapic_t* srat_lapic_list[256] = {0};
+acpi_srat_memory_t* srat_memory_list[256] = {0};
+acpi_srat_x2apic_t* srat_x2apic_list[256] = {0};
+
+uint32_t srat_lapic_len = 0;
+uint32_t srat_memory_len = 0;
+uint32_t srat_x2apic_len = 0;
+
+acpi_slit_t* slit = NULL;
+
+void srat_init() {
+    acpi_srat_t* srat = (acpi_srat_t*)acpi_find_table("SRAT");
+    if (!srat || srat->sdt.length < sizeof(acpi_srat_t)) {
+        log_early("SRAT: not present, assuming a single NUMA node");
+        return;
+    }
+
+    uint64_t offset = 0;
+    while (offset + sizeof(acpi_srat_entry_t) <=
+           srat->sdt.length - sizeof(acpi_srat_t)) {
+        acpi_srat_entry_t* entry = (acpi_srat_entry_t*)(srat->table + offset);
+        if (entry->length == 0 ||
+            offset + entry->length > srat->sdt.length - sizeof(acpi_srat_t)) {
+            log_early("warning: SRAT: invalid entry length, stopping");
+            break;
+        }
+
+        switch (entry->type) {
+        case SRAT_ENTRY_LAPIC: // Type 0: Processor Local APIC Affinity
+        {
+            acpi_srat_lapic_t* lapic = (acpi_srat_lapic_t*)entry;
+            if (entry->length < sizeof(acpi_srat_lapic_t) ||
+                !(lapic->flags & SRAT_ENABLED))
+                break;
+            if (srat_lapic_len < 256)
+                srat_lapic_list[srat_lapic_len++] = lapic;
+            break;
+        }
+        case SRAT_ENTRY_MEMORY: // Type 1: Memory Affinity
+        {
+            acpi_srat_memory_t* mem = (acpi_srat_memory_t*)entry;
+            if (entry->length < sizeof(acpi_srat_memory_t) ||
+                !(mem->flags & SRAT_ENABLED))
+                break;
+            if (srat_memory_len < 256)
+                srat_memory_list[srat_memory_len++] = mem;
+            log_early("SRAT: Memory 0x%.16llx -> 0x%.16llx, domain=%u, "
+                      "flags=0x%x",
+                      mem->base, mem->base + mem->length, mem->domain,
+                      mem->flags);
+            break;
+        }
+        case SRAT_ENTRY_X2APIC: // Type 2: Processor Local x2APIC Affinity
+        {
+            acpi_srat_x2apic_t* x2apic = (acpi_srat_x2apic_t*)entry;
+            if (entry->length < sizeof(acpi_srat_x2apic_t) ||
+                !(x2apic->flags & SRAT_ENABLED))
+                break;
+            if (srat_x2apic_len < 256)
+                srat_x2apic_list[srat_x2apic_len++] = x2apic;
+            break;
+        }
+        default:
+            break;
+        }
+
+        offset += entry->length;
+    }
+
+    slit = (acpi_slit_t*)acpi_find_table("SLIT");
+    if (slit && slit->sdt.length < sizeof(acpi_slit_t) +
+                                       slit->localities * slit->localities) {
+        log_early("warning: SLIT: truncated table, ignoring it");
+        slit = NULL;
+    }
+
+    log_early("SRAT parsed: %u LAPIC(s), %u memory range(s), %u x2APIC(s), "
+              "SLIT: %s",
+              srat_lapic_len, srat_memory_len, srat_x2apic_len,
+              slit ? "yes" : "no");
+}
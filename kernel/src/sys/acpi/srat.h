@@ -0,0 +1,78 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef SRAT_H
+#define SRAT_H
+
+#include <stdint.h>
+#include <sys/acpi.h>
+
+#define SRAT_ENTRY_LAPIC 0  /* Processor Local APIC/SAPIC Affinity */
+#define SRAT_ENTRY_MEMORY 1 /* Memory Affinity */
+#define SRAT_ENTRY_X2APIC 2 /* Processor Local x2APIC Affinity */
+
+#define SRAT_ENABLED (1 << 0)
+
+typedef struct acpi_srat {
+    acpi_sdt_header_t sdt;
+    uint32_t reserved1; /* Must be 1 */
+    uint64_t reserved2;
+    char table[];
+} __attribute__((packed)) acpi_srat_t;
+
+typedef struct acpi_srat_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_srat_entry_t;
+
+/* Entry Type 0: Processor Local APIC/SAPIC Affinity */
+typedef struct acpi_srat_lapic {
+    acpi_srat_entry_t header;
+    uint8_t domain_lo;    /* Proximity Domain bits [7:0] */
+    uint8_t apic_id;      /* Local APIC ID */
+    uint32_t flags;       /* Bit 0: Enabled */
+    uint8_t sapic_eid;    /* Local SAPIC EID */
+    uint8_t domain_hi[3]; /* Proximity Domain bits [31:8] */
+    uint32_t clock_domain;
+} __attribute__((packed)) acpi_srat_lapic_t;
+
+/* Entry Type 1: Memory Affinity */
+typedef struct acpi_srat_memory {
+    acpi_srat_entry_t header;
+    uint32_t domain; /* Proximity Domain */
+    uint16_t reserved1;
+    uint64_t base;   /* Base Address */
+    uint64_t length; /* Length in bytes */
+    uint32_t reserved2;
+    uint32_t flags; /* Bit 0: Enabled, Bit 1: Hot Pluggable, Bit 2: NV */
+    uint64_t reserved3;
+} __attribute__((packed)) acpi_srat_memory_t;
+
+/* Entry Type 2: Processor Local x2APIC Affinity */
+typedef struct acpi_srat_x2apic {
+    acpi_srat_entry_t header;
+    uint16_t reserved1;
+    uint32_t domain;    /* Proximity Domain */
+    uint32_t x2apic_id; /* Processor's x2APIC ID */
+    uint32_t flags;     /* Bit 0: Enabled */
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_t;
+
+/* System Locality Information Table, distances between proximity domains */
+typedef struct acpi_slit {
+    acpi_sdt_header_t sdt;
+    uint64_t localities;
+    uint8_t entries[]; /* localities * localities, row major */
+} __attribute__((packed)) acpi_slit_t;
+
+extern acpi_srat_lapic_t* srat_lapic_list[256];
+extern acpi_srat_memory_t* srat_memory_list[256];
+extern acpi_srat_x2apic_t* srat_x2apic_list[256];
+extern uint32_t srat_lapic_len;
+extern uint32_t srat_memory_len;
+extern uint32_t srat_x2apic_len;
+extern acpi_slit_t* slit;
+
+/* Both tables are optional, the lists stay empty without them */
+void srat_init();
+
+#endif // SRAT_H
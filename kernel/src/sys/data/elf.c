@@ -50,6 +50,64 @@ typedef struct {
 #define PF_W 0x2 // Write
 #define PF_R 0x4 // Read
 
+/*
+ * Map one PT_LOAD segment. When the file offset and the address agree on
+ * where in a page they are, the whole pages of file data are mapped straight
+ * out of the module instead of being copied, copy-on-write if the segment is
+ * writable. The page the file data ends in is copied, since the rest of it
+ * isn't ours to show, and the .bss after that is zero filled on demand.
+ */
+static bool load_segment(void* data, elf_pheader_t* ph, vctx_t* ctx,
+                         uint64_t flags) {
+    uint64_t vaddr_start = ALIGN_DOWN(ph->p_vaddr, PAGE_SIZE);
+    uint64_t vaddr_end = ALIGN_UP(ph->p_vaddr + ph->p_memsz, PAGE_SIZE);
+    uint64_t file_end = ph->p_vaddr + ph->p_filesz;
+    uint8_t* src = (uint8_t*)data + ph->p_offset;
+
+    uint64_t shared_end = vaddr_start;
+    if (!((uint64_t)data & (PAGE_SIZE - 1)) &&
+        (ph->p_offset & (PAGE_SIZE - 1)) == (ph->p_vaddr & (PAGE_SIZE - 1)))
+        shared_end = ALIGN_DOWN(file_end, PAGE_SIZE);
+
+    if (shared_end > vaddr_start) {
+        uint64_t phys = (uint64_t)PHYSICAL(src);
+        size_t pages = (shared_end - vaddr_start) / PAGE_SIZE;
+        if (!vadd(ctx, vaddr_start, phys, pages, flags | VALLOC_SHARED)) {
+            log("error: Failed to map ELF segment at 0x%lx", vaddr_start);
+            return false;
+        }
+    }
+
+    uint64_t copy_end = ALIGN_UP(file_end, PAGE_SIZE);
+    if (copy_end > shared_end) {
+        size_t pages = (copy_end - shared_end) / PAGE_SIZE;
+        uint64_t phys = (uint64_t)palloc(pages, false);
+        if (!phys) {
+            log("error: Out of physical memory while loading ELF segment.");
+            return false;
+        }
+
+        if (!vadd(ctx, shared_end, phys, pages, flags)) {
+            log("error: Failed to map ELF segment at 0x%lx", shared_end);
+            pfree((void*)phys, pages);
+            return false;
+        }
+
+        uint64_t from = shared_end > ph->p_vaddr ? shared_end : ph->p_vaddr;
+        memcpy((uint8_t*)HIGHER_HALF(phys) + (from - shared_end),
+               src + (from - ph->p_vaddr), file_end - from);
+    }
+
+    if (vaddr_end > copy_end &&
+        !vallocfixed(ctx, copy_end, (vaddr_end - copy_end) / PAGE_SIZE,
+                     flags | VALLOC_LAZY)) {
+        log("error: Failed to map ELF segment at 0x%lx", copy_end);
+        return false;
+    }
+
+    return true;
+}
+
 uint64_t elf_load(bool user, void* data, vctx_t* ctx) {
     assert(data);
     assert(ctx);
@@ -76,10 +134,6 @@ uint64_t elf_load(bool user, void* data, vctx_t* ctx) {
         if (ph[i].p_type != PT_LOAD)
             continue;
 
-        uint64_t vaddr_start = ALIGN_DOWN(ph[i].p_vaddr, PAGE_SIZE);
-        uint64_t vaddr_end = ALIGN_UP(ph[i].p_vaddr + ph[i].p_memsz, PAGE_SIZE);
-        size_t pages = (vaddr_end - vaddr_start) / PAGE_SIZE;
-
         uint64_t flags = VALLOC_READ;
         if (ph[i].p_flags & PF_W)
             flags |= VALLOC_WRITE;
@@ -88,25 +142,8 @@ uint64_t elf_load(bool user, void* data, vctx_t* ctx) {
         if (user)
             flags |= VALLOC_USER;
 
-        uint64_t phys = (uint64_t)palloc(pages, false);
-        if (!phys) {
-            log("error: Out of physical memory while loading ELF segment.");
+        if (!load_segment(data, &ph[i], ctx, flags))
             return 0;
-        }
-
-        if (!vadd(ctx, vaddr_start, phys, pages, flags)) {
-            log("error: Failed to map ELF segment at 0x%lx", vaddr_start);
-            pfree((void*)phys, pages);
-            return 0;
-        }
-
-        memset((void*)HIGHER_HALF(phys), 0, pages * PAGE_SIZE);
-
-        uint64_t file_offset = ph[i].p_offset;
-        uint64_t mem_offset = ph[i].p_vaddr - vaddr_start;
-        void* dest = (void*)(HIGHER_HALF(phys) + mem_offset);
-        void* src = (uint8_t*)data + file_offset;
-        memcpy(dest, src, ph[i].p_filesz);
     }
 
     return header->e_entry;
@@ -5,6 +5,7 @@
 #include <lib/string.h>
 #include <mm/heap.h>
 #include <mm/pmm.h>
+#include <mm/slab.h>
 #include <sys/kpanic.h>
 #include <sys/sched.h>
 #include <sys/spinlock.h>
@@ -28,25 +29,23 @@ static inline uint32_t atomic_inc_fetch(atomic_t* atom) {
 
 #define PROC_DEFAULT_TIME 1
 #define PROC_MAX_PROCS_PER_CPU 512
+#define PROC_IDLE_STACK_PAGES 4
 
 typedef struct {
     pcb_t** procs;
     uint32_t count;
     uint32_t current_pid;
+    pcb_t* idle;    // Runs cpu_idle() when nothing else can
+    pcb_t* running; // Owner of the interrupted context, NULL during boot
     spinlock_t lock;
 } cpu_sched_t;
 
 static cpu_sched_t cpu_schedulers[MAX_CPUS];
 static atomic_t global_pid_counter = ATOMIC_INIT(0);
+static slab_cache_t pcb_cache;
 
-void map_range_to_pagemap(uint64_t* dest_pagemap, uint64_t* src_pagemap,
-                          uint64_t start, uint64_t size, uint64_t flags) {
-    for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        uint64_t phys = virt_to_phys(src_pagemap, start + offset);
-        if (phys) {
-            vmap(dest_pagemap, start + offset, phys, flags);
-        }
-    }
+void sched_early_init(void) {
+    slab_cache_init(&pcb_cache, "pcb_t", sizeof(pcb_t), 16, NULL);
 }
 
 void sched_init(void) {
@@ -63,6 +62,27 @@ void sched_init(void) {
     sched->count = 0;
     sched->current_pid = 0;
     spinlock_init(&sched->lock);
+
+    /* Never in the proc list, sched_tick() falls back to it */
+    pcb_t* idle = (pcb_t*)slab_alloc(&pcb_cache);
+    void* stack = kmalloc(PAGE_SIZE * PROC_IDLE_STACK_PAGES);
+    if (!idle || !stack) {
+        kpanic(NULL, "Failed to allocate the idle task for CPU %d",
+               cpu->cpu_index);
+        return;
+    }
+
+    memset(idle, 0, sizeof(pcb_t));
+    idle->state = PROC_READY;
+    idle->pagemap = kernel_pagemap;
+    idle->vctx = kvm_ctx;
+    idle->ctx.rip = (uint64_t)cpu_idle;
+    idle->ctx.cs = 0x08;
+    idle->ctx.ss = 0x10;
+    idle->ctx.rsp = (uint64_t)stack + (PAGE_SIZE * PROC_IDLE_STACK_PAGES);
+    idle->ctx.rflags = 0x202;
+    sched->idle = idle;
+    sched->running = NULL;
 }
 
 uint32_t sched_spawn(bool user, void (*entry)(void), uint64_t* pagemap,
@@ -79,7 +99,7 @@ uint32_t sched_spawn(bool user, void (*entry)(void), uint64_t* pagemap,
         return 0;
     }
 
-    pcb_t* proc = (pcb_t*)kmalloc(sizeof(pcb_t));
+    pcb_t* proc = (pcb_t*)slab_alloc(&pcb_cache);
     if (!proc) {
         spinlock_release(&sched->lock);
         kpanic(NULL, "Failed to allocate memory for new proc");
@@ -94,9 +114,7 @@ uint32_t sched_spawn(bool user, void (*entry)(void), uint64_t* pagemap,
     proc->vctx = vctx ? vctx : vinit(proc->pagemap, 0x10000);
 
     uint64_t stack_size = 4; // 4 pages ~16KB
-    uint64_t map_flags = VMM_PRESENT | VMM_WRITE;
     if (user) {
-        map_flags |= VMM_USER;
         proc->ctx.cs = 0x1B;
         proc->ctx.ss = 0x23;
     } else {
@@ -106,9 +124,15 @@ uint32_t sched_spawn(bool user, void (*entry)(void), uint64_t* pagemap,
 
     proc->user = user;
 
-    void* stack = valloc(proc->vctx, stack_size, map_flags);
+    /*
+     * User stacks are backed as they're touched. Kernel ones can't be, the
+     * CPU pushes the #PF frame onto the very stack that's missing.
+     */
+    uint64_t stack_flags =
+        user ? VALLOC_RW | VALLOC_USER | VALLOC_LAZY : VALLOC_RW;
+    void* stack = valloc(proc->vctx, stack_size, stack_flags);
     if (!stack) {
-        kfree(proc);
+        slab_free(&pcb_cache, proc);
         sched->count--;
         spinlock_release(&sched->lock);
         kpanic(NULL, "Failed to allocate stack for new proc");
@@ -118,18 +142,6 @@ uint32_t sched_spawn(bool user, void (*entry)(void), uint64_t* pagemap,
     proc->ctx.rsp = (uint64_t)stack + (PAGE_SIZE * stack_size);
     proc->ctx.rflags = 0x202;
 
-    vmap(proc->pagemap, (uint64_t)proc,
-         virt_to_phys(kernel_pagemap, (uint64_t)proc), map_flags);
-    map_range_to_pagemap(proc->pagemap, kernel_pagemap, (uint64_t)sched->procs,
-                         sizeof(pcb_t*) * PROC_MAX_PROCS_PER_CPU, map_flags);
-
-    for (vregion_t* region = kvm_ctx->root; region != NULL;
-         region = region->next) {
-        uint64_t size = region->pages * PAGE_SIZE;
-        map_range_to_pagemap(proc->pagemap, kernel_pagemap, region->start, size,
-                             map_flags);
-    }
-
     proc->timeslice = PROC_DEFAULT_TIME;
     sched->procs[sched->count++] = proc;
 
@@ -145,22 +157,25 @@ void sched_tick(struct register_ctx* ctx) {
     cpu_sched_t* sched = &cpu_schedulers[cpu->cpu_index];
 
     spinlock_acquire(&sched->lock);
-    if (sched->count == 0) {
+    if (sched->count == 0 && !sched->running) {
         spinlock_release(&sched->lock);
-        pmset(kernel_pagemap);
+        vswitch(kvm_ctx);
         return;
     }
 
-    pcb_t* current_proc = sched->procs[sched->current_pid];
-    if (current_proc && current_proc->state == PROC_RUNNING) {
-        memcpy(&current_proc->ctx, ctx, sizeof(struct register_ctx));
+    pcb_t* prev = sched->running;
+    if (prev && prev->state == PROC_RUNNING) {
+        memcpy(&prev->ctx, ctx, sizeof(struct register_ctx));
 
-        if (--current_proc->timeslice == 0) {
-            current_proc->state = PROC_READY;
-            current_proc->timeslice = PROC_DEFAULT_TIME;
+        if (prev != sched->idle && --prev->timeslice == 0) {
+            prev->state = PROC_READY;
+            prev->timeslice = PROC_DEFAULT_TIME;
         }
     }
 
+    // prev may be freed below if it's terminated
+    bool prev_running = prev && prev->state == PROC_RUNNING;
+
     uint32_t start_pid = sched->current_pid;
     pcb_t* next_proc = NULL;
     do {
@@ -168,9 +183,10 @@ void sched_tick(struct register_ctx* ctx) {
         next_proc = sched->procs[sched->current_pid];
 
         if (next_proc && next_proc->state == PROC_TERMINATED) {
+            if (next_proc == sched->running)
+                sched->running = NULL;
             vdestroy(next_proc->vctx);
-            vunmap(next_proc->pagemap, (uint64_t)next_proc);
-            kfree(next_proc);
+            slab_free(&pcb_cache, next_proc);
 
             for (uint32_t i = sched->current_pid; i < sched->count - 1; i++) {
                 sched->procs[i] = sched->procs[i + 1];
@@ -179,7 +195,8 @@ void sched_tick(struct register_ctx* ctx) {
             sched->count--;
             next_proc = NULL;
         }
-    } while (!next_proc && sched->current_pid != start_pid && sched->count > 0);
+    } while ((!next_proc || next_proc->state == PROC_WAITING) &&
+             sched->current_pid != start_pid && sched->count > 0);
 
     if (!next_proc && sched->count > 0) {
         sched->current_pid = 0;
@@ -187,14 +204,20 @@ void sched_tick(struct register_ctx* ctx) {
     }
 
     if (next_proc && next_proc->state == PROC_READY) {
+        if (prev_running)
+            prev->state = PROC_READY;
         next_proc->state = PROC_RUNNING;
-        pmset(next_proc->pagemap);
+        sched->running = next_proc;
+        vswitch(next_proc->vctx);
         memcpy(ctx, &next_proc->ctx, sizeof(struct register_ctx));
-    } else if (sched->count == 0) {
-        log("No processes remaining on CPU %d. Halting.", cpu->cpu_index);
-        spinlock_release(&sched->lock);
-        pmset(kernel_pagemap);
-        hlt();
+    } else if (!prev_running) {
+        /* Nothing can run, scrub pages or halt until something can */
+        if (sched->count == 0)
+            log("No processes remaining on CPU %d, idling", cpu->cpu_index);
+        sched->idle->state = PROC_RUNNING;
+        sched->running = sched->idle;
+        vswitch(kvm_ctx);
+        memcpy(ctx, &sched->idle->ctx, sizeof(struct register_ctx));
     }
 
     spinlock_release(&sched->lock);
@@ -243,7 +266,7 @@ pcb_t* sched_get_current(void) {
     }
 
     cpu_sched_t* sched = &cpu_schedulers[cpu->cpu_index];
-    if (!sched || sched->count == 0) {
+    if (!sched || sched->count == 0 || sched->running == sched->idle) {
         return NULL;
     }
 
@@ -32,6 +32,7 @@ typedef struct pcb {
     bool user;
 } pcb_t;
 
+void sched_early_init(void);
 void sched_init();
 uint32_t sched_spawn(bool user, void (*entry)(void), uint64_t* pagemap,
                      vctx_t* vctx);
@@ -9,9 +9,24 @@ typedef struct {
     volatile uint32_t lock;
 } spinlock_t;
 
+/*
+ * TLB shootdowns arrive by IPI, which a CPU spinning with IRQs off never
+ * takes, and the holder of the lock may be waiting for it to answer one.
+ * So spinning answers them by hand, see arch/paging.c.
+ */
+void tlb_poll(void);
+
 static inline void spinlock_init(spinlock_t* lock) { lock->lock = 0; }
 
 static inline void spinlock_acquire(spinlock_t* lock) {
+    while (__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE)) {
+        tlb_poll();
+        __asm__ volatile("pause" ::: "memory");
+    }
+}
+
+/* For the locks tlb_poll() takes itself */
+static inline void spinlock_acquire_raw(spinlock_t* lock) {
     while (__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE)) {
         __asm__ volatile("pause" ::: "memory");
     }
@@ -1,4 +1,5 @@
 /* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/paging.h>
 #include <arch/smp.h>
 #include <boot/emk.h>
 #include <lib/string.h>
@@ -7,18 +8,19 @@
 #include <sys/sched.h>
 #include <sys/syscall.h>
 #include <sys/user.h>
+#include <util/align.h>
 #include <util/errno.h>
 #include <util/log.h>
 
-static int sys_exit(uintptr_t code, __unused uintptr_t unused1,
-                    __unused uintptr_t unused2) {
+static long sys_exit(uintptr_t code, __unused uintptr_t unused1,
+                     __unused uintptr_t unused2) {
     if (!sched_get_current())
         return -ESRCH;
     proc_exit((int)code);
     return 0;
 }
 
-static int sys_kping() {
+static long sys_kping() {
     if (!sched_get_current())
         return -ESRCH;
 
@@ -28,9 +30,54 @@ static int sys_kping() {
     return 0;
 }
 
+static long sys_mmap(uintptr_t addr, uintptr_t length, uintptr_t prot) {
+    pcb_t* proc = sched_get_current();
+    if (!proc)
+        return -ESRCH;
+
+    if (length == 0 || length > VPM_USER_END || (addr & (PAGE_SIZE - 1)) ||
+        (prot & ~(uintptr_t)(PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return -EINVAL;
+
+    size_t pages = DIV_ROUND_UP(length, PAGE_SIZE);
+    /* PROT_* match VALLOC_*, user mappings are only backed when touched */
+    uint64_t flags = prot | (proc->user ? VALLOC_USER | VALLOC_LAZY : 0);
+
+    void* ptr;
+    if (addr) {
+        if (addr < proc->vctx->start ||
+            addr > VPM_USER_END - pages * PAGE_SIZE)
+            return -EINVAL;
+        ptr = vallocfixed(proc->vctx, addr, pages, flags); // NULL on overlap
+    } else {
+        ptr = valloc(proc->vctx, pages, flags);
+    }
+
+    return ptr ? (long)ptr : -ENOMEM;
+}
+
+static long sys_munmap(uintptr_t addr, uintptr_t length,
+                       __unused uintptr_t unused) {
+    pcb_t* proc = sched_get_current();
+    if (!proc)
+        return -ESRCH;
+
+    /* Only whole mappings, and only the ones user space could have made */
+    vregion_t* region = vget(proc->vctx, addr);
+    if (!region || region->start != addr ||
+        region->pages != DIV_ROUND_UP(length, PAGE_SIZE) ||
+        (proc->user && !(region->flags & VMM_USER)))
+        return -EINVAL;
+
+    vfree(proc->vctx, (void*)addr);
+    return 0;
+}
+
 static syscall_fn_t syscall_table[] = {
     [SYS_exit] = sys_exit,
     [SYS_kping] = sys_kping,
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,
 };
 
 long syscall_dispatch(uint64_t num, uint64_t arg1, uint64_t arg2,
@@ -2,16 +2,30 @@
 #define SYSCALL_H
 
 #include <stdint.h>
+#include <sys/syscalls.h>
 
-enum { SYS_exit = 0, SYS_kping, SYSCALL_TABLE_SIZE };
+enum {
+#define X(name, argc) SYS_##name,
+    SYSCALL_LIST(X)
+#undef X
+    SYSCALL_TABLE_SIZE
+};
 
-typedef int (*syscall_fn_t)(uintptr_t, uintptr_t, uintptr_t);
+typedef long (*syscall_fn_t)(uintptr_t, uintptr_t, uintptr_t);
 
 long syscall_dispatch(uint64_t num, uint64_t arg1, uint64_t arg2,
                       uint64_t arg3);
 
-#define SYSCALL_TO_STR(n)                                                      \
-    ((n) == SYS_exit ? "exit" : (n) == SYS_kping ? "kping" : "unknown")
+static inline const char* syscall_to_str(uint64_t num) {
+    static const char* names[] = {
+#define X(name, argc) #name,
+        SYSCALL_LIST(X)
+#undef X
+    };
+    return num < SYSCALL_TABLE_SIZE ? names[num] : "unknown";
+}
+
+#define SYSCALL_TO_STR(n) syscall_to_str(n)
 
 static inline long syscall(uint64_t num, uint64_t arg1, uint64_t arg2,
                            uint64_t arg3) {
@@ -0,0 +1,26 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef SYSCALLS_H
+#define SYSCALLS_H
+
+/*
+ * The system call list, also included by user space (libemk/ builds its
+ * wrappers from it) so keep it free of kernel headers. X(name, argc) per
+ * call, numbered in order, so new calls only ever go at the end.
+ */
+#define SYSCALL_LIST(X)                                                        \
+    X(exit, 1)                                                                 \
+    X(kping, 0)                                                                \
+    X(mmap, 3)                                                                 \
+    X(munmap, 2)
+
+/*
+ * mmap(addr, length, prot) maps zeroed pages at addr, or wherever there's
+ * room if addr is 0, and returns the address or -errno. munmap(addr, length)
+ * takes back exactly one earlier mapping.
+ */
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#endif // SYSCALLS_H
@@ -11,11 +11,14 @@ int copy_from_user(vctx_t* vctx, void* kdst, const void* usrc, size_t len) {
     size_t copied = 0;
     uint8_t* dst = (uint8_t*)kdst;
     uint64_t src_addr = (uint64_t)usrc;
+    vregion_t* r = NULL;
 
     while (copied < len) {
-        vregion_t* r = vget(vctx, src_addr);
-        if (!r || !(r->flags & VMM_USER))
-            return -1;
+        if (!r || src_addr >= r->start + r->pages * PAGE_SIZE) {
+            r = vget(vctx, src_addr);
+            if (!r || !(r->flags & VMM_USER))
+                return -1;
+        }
 
         size_t page_offset = src_addr & (PAGE_SIZE - 1);
         size_t chunk = min_size(len - copied, PAGE_SIZE - page_offset);
@@ -33,11 +36,14 @@ int copy_to_user(vctx_t* vctx, void* user_dst, const void* kernel_src,
     size_t copied = 0;
     uint64_t dst_addr = (uint64_t)user_dst;
     const uint8_t* src = (const uint8_t*)kernel_src;
+    vregion_t* r = NULL;
 
     while (copied < len) {
-        vregion_t* r = vget(vctx, dst_addr);
-        if (!r || !(r->flags & VMM_USER) || !(r->flags & VMM_WRITE))
-            return -1;
+        if (!r || dst_addr >= r->start + r->pages * PAGE_SIZE) {
+            r = vget(vctx, dst_addr);
+            if (!r || !(r->flags & VMM_USER) || !(r->flags & VMM_WRITE))
+                return -1;
+        }
 
         size_t page_offset = dst_addr & (PAGE_SIZE - 1);
         size_t chunk = min_size(len - copied, PAGE_SIZE - page_offset);
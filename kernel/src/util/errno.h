@@ -12,6 +12,7 @@ typedef unsigned int errno_t;
 #define ENOSYS 5  // Function not implemented
 #define EAGAIN 6  // Try again (resource temporarily unavailable)
 #define EINTR 7   // Interrupted system call
+#define ENOMEM 8  // Out of memory
 
 #define ERRNO_TO_STR(errno)                                                    \
     ((errno) == EOK       ? "No error"                                         \
@@ -22,6 +23,7 @@ typedef unsigned int errno_t;
      : (errno) == ENOSYS  ? "Function not implemented"                         \
      : (errno) == EAGAIN  ? "Resource temporarily unavailable"                 \
      : (errno) == EINTR   ? "Interrupted system call"                          \
+     : (errno) == ENOMEM  ? "Out of memory"                                    \
                           : "Unknown error")
 
 #endif // ERRNO_H
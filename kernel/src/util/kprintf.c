@@ -1,4 +1,5 @@
 /* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <arch/cpu.h>
 #include <boot/emk.h>
 #include <dev/serial.h>
 #include <util/kprintf.h>
@@ -19,7 +20,9 @@
 
 static spinlock_t kprintf_lock = {0};
 
+/* Interrupt handlers log too, so the lock can't be held with them enabled */
 int kprintf(const char* fmt, ...) {
+    uint64_t flags = irq_save();
     spinlock_acquire(&kprintf_lock);
 
     va_list args;
@@ -38,6 +41,7 @@ int kprintf(const char* fmt, ...) {
     va_end(args);
 
     spinlock_release(&kprintf_lock);
+    irq_restore(flags);
     return length;
 }
 
@@ -0,0 +1,13 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef EMK_MALLOC_H
+#define EMK_MALLOC_H
+
+#include <stddef.h>
+
+/* All results are 16 byte aligned */
+void* malloc(size_t size);
+void* calloc(size_t count, size_t size);
+void* realloc(void* ptr, size_t size);
+void free(void* ptr);
+
+#endif // EMK_MALLOC_H
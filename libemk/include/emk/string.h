@@ -0,0 +1,20 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef EMK_STRING_H
+#define EMK_STRING_H
+
+#include <stddef.h>
+
+void* memcpy(void* restrict dest, const void* restrict src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+void* memset(void* s, int c, size_t n);
+int memcmp(const void* s1, const void* s2, size_t n);
+void* memchr(const void* s, int c, size_t n);
+
+size_t strlen(const char* str);
+size_t strnlen(const char* str, size_t max);
+int strcmp(const char* s1, const char* s2);
+int strncmp(const char* s1, const char* s2, size_t n);
+char* strcpy(char* restrict dest, const char* restrict src);
+char* strchr(const char* s, int c);
+
+#endif // EMK_STRING_H
@@ -0,0 +1,47 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#ifndef EMK_SYSCALL_H
+#define EMK_SYSCALL_H
+
+#include <stdint.h>
+#include <sys/syscalls.h>
+
+/*
+ * One sys_<name>() wrapper per entry in the kernel's SYSCALL_LIST, so a new
+ * system call only has to be added there. They return what the kernel
+ * does, -errno on failure.
+ */
+
+enum {
+#define X(name, argc) SYS_##name,
+    SYSCALL_LIST(X)
+#undef X
+};
+
+static inline long syscall(uint64_t num, uint64_t arg1, uint64_t arg2,
+                           uint64_t arg3) {
+    long ret;
+    __asm__ volatile("int $0x80"
+                     : "=a"(ret)
+                     : "a"(num), "D"(arg1), "S"(arg2), "d"(arg3)
+                     : "memory");
+    return ret;
+}
+
+#define SYSCALL_PARAMS_0 void
+#define SYSCALL_PARAMS_1 uint64_t arg1
+#define SYSCALL_PARAMS_2 uint64_t arg1, uint64_t arg2
+#define SYSCALL_PARAMS_3 uint64_t arg1, uint64_t arg2, uint64_t arg3
+
+#define SYSCALL_ARGS_0 0, 0, 0
+#define SYSCALL_ARGS_1 arg1, 0, 0
+#define SYSCALL_ARGS_2 arg1, arg2, 0
+#define SYSCALL_ARGS_3 arg1, arg2, arg3
+
+#define X(name, argc)                                                          \
+    static inline long sys_##name(SYSCALL_PARAMS_##argc) {                     \
+        return syscall(SYS_##name, SYSCALL_ARGS_##argc);                       \
+    }
+SYSCALL_LIST(X)
+#undef X
+
+#endif // EMK_SYSCALL_H
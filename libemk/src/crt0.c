@@ -0,0 +1,22 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <emk/syscall.h>
+
+/*
+ * Program entry. The kernel drops us here with no return address on the
+ * stack, align it and call in so main() starts out like any C function.
+ */
+int main(void);
+
+void __libemk_start(void) {
+    sys_exit(main());
+    for (;;)
+        ;
+}
+
+__asm__(".text\n"
+        ".global _start\n"
+        "_start:\n"
+        "    xorl %ebp, %ebp\n"
+        "    andq $-16, %rsp\n"
+        "    call __libemk_start\n"
+        "    ud2\n");
@@ -0,0 +1,314 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <emk/malloc.h>
+#include <emk/string.h>
+#include <emk/syscall.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Thread-caching allocator, tcmalloc in miniature.
+ *
+ * Memory comes from the kernel with mmap() in 1 MiB chunks, placed at fixed
+ * addresses in a part of the address space we keep to ourselves and cut
+ * into 64 KiB spans aligned to their size. A span serves a single size
+ * class or holds one large allocation. Its header is at the start, so
+ * free() finds it by masking the pointer.
+ *
+ * Each thread keeps a cache of free objects per class. malloc() and free()
+ * only touch that cache and move objects in batches to and from the spans,
+ * under the central lock, when it runs dry or grows past its limit. Only
+ * running out of spans and allocations above MAX_SMALL enter the kernel.
+ */
+#define HEAP_BASE 0x0000100000000000ULL
+#define HEAP_END 0x0000700000000000ULL
+#define PAGE_SIZE 0x1000ULL
+#define SPAN_SIZE 0x10000ULL
+#define CHUNK_SIZE 0x100000ULL
+
+#define SPAN_MAGIC 0x5BA45BA4
+#define SPAN_LARGE 0xFFFFFFFF
+#define MAX_SMALL 8192
+
+#define ALIGN_UP(x, y) (((x) + (y) - 1) & ~((uint64_t)(y) - 1))
+
+typedef struct span {
+    uint32_t magic;
+    uint32_t class; // SPAN_LARGE for large allocations
+    uint64_t pages; // Mapped for a large allocation
+    struct span* next;
+    struct span* prev;
+    void* free;     // Objects handed back to this span
+    uint8_t* bump;  // Objects never handed out start here
+    uint32_t inuse; // Objects out of the span, thread caches included
+} span_t;
+
+#define SPAN_HEADER ALIGN_UP(sizeof(span_t), 16)
+
+/* 16 byte steps up to 128, then four classes per power of two */
+static const uint32_t class_sizes[] = {
+    16,   32,   48,   64,   80,   96,   112,  128,  160,  192,  224,
+    256,  320,  384,  448,  512,  640,  768,  896,  1024, 1280, 1536,
+    1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192};
+#define CLASS_COUNT (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+typedef struct {
+    void* head;
+    uint32_t count;
+} cache_bin_t;
+
+/* One cache per thread, there's only ever one thread per process for now */
+static cache_bin_t cache[CLASS_COUNT];
+
+static bool central_lock;
+static span_t* partial[CLASS_COUNT]; // Spans with objects left
+static span_t* free_spans;           // Empty spans, any class can take them
+static uint64_t chunk_next, chunk_end;
+static uint64_t heap_top = HEAP_BASE;
+
+static inline void lock(void) {
+    while (__atomic_test_and_set(&central_lock, __ATOMIC_ACQUIRE))
+        __asm__ volatile("pause");
+}
+
+static inline void unlock(void) {
+    __atomic_clear(&central_lock, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t class_of(size_t size) {
+    if (size <= 128)
+        return (size - 1) >> 4;
+
+    uint32_t lg = 63 - __builtin_clzll(size - 1);
+    return 8 + (lg - 7) * 4 + ((size - 1) >> (lg - 2)) - 4;
+}
+
+/* Objects moved per refill or flush, about a page worth */
+static inline uint32_t batch_of(uint32_t class) {
+    uint32_t batch = 4096 / class_sizes[class];
+    return batch < 2 ? 2 : batch > 32 ? 32 : batch;
+}
+
+static inline span_t* span_of(void* ptr) {
+    return (span_t*)((uint64_t)ptr & ~(SPAN_SIZE - 1));
+}
+
+static inline bool span_full(span_t* span) {
+    return !span->free && (uint64_t)span->bump + class_sizes[span->class] >
+                              (uint64_t)span + SPAN_SIZE;
+}
+
+static void partial_remove(span_t* span) {
+    if (span->prev)
+        span->prev->next = span->next;
+    else
+        partial[span->class] = span->next;
+    if (span->next)
+        span->next->prev = span->prev;
+}
+
+/* Claim address space, it's never given back */
+static uint64_t heap_reserve(uint64_t bytes) {
+    if (bytes > HEAP_END - heap_top)
+        return 0;
+
+    uint64_t addr = heap_top;
+    heap_top += ALIGN_UP(bytes, SPAN_SIZE);
+    return addr;
+}
+
+/* A fresh span for class, central lock held */
+static span_t* span_new(uint32_t class) {
+    span_t* span = free_spans;
+
+    if (span) {
+        free_spans = span->next;
+    } else {
+        if (chunk_next == chunk_end) {
+            uint64_t addr = heap_reserve(CHUNK_SIZE);
+            if (!addr || sys_mmap(addr, CHUNK_SIZE, PROT_READ | PROT_WRITE) < 0)
+                return NULL;
+            chunk_next = addr;
+            chunk_end = addr + CHUNK_SIZE;
+        }
+        span = (span_t*)chunk_next;
+        chunk_next += SPAN_SIZE;
+    }
+
+    span->magic = SPAN_MAGIC;
+    span->class = class;
+    span->free = NULL;
+    span->bump = (uint8_t*)span + SPAN_HEADER;
+    span->inuse = 0;
+
+    span->prev = NULL;
+    span->next = partial[class];
+    if (span->next)
+        span->next->prev = span;
+    partial[class] = span;
+    return span;
+}
+
+/* One object out of the spans, central lock held */
+static void* central_take(uint32_t class) {
+    span_t* span = partial[class];
+    if (!span && !(span = span_new(class)))
+        return NULL;
+
+    void* obj = span->free;
+    if (obj) {
+        span->free = *(void**)obj;
+    } else {
+        obj = span->bump;
+        span->bump += class_sizes[class];
+    }
+
+    span->inuse++;
+    if (span_full(span))
+        partial_remove(span);
+    return obj;
+}
+
+/* One object back to its span, central lock held */
+static void central_put(void* obj) {
+    span_t* span = span_of(obj);
+
+    if (span_full(span)) {
+        span->prev = NULL;
+        span->next = partial[span->class];
+        if (span->next)
+            span->next->prev = span;
+        partial[span->class] = span;
+    }
+
+    *(void**)obj = span->free;
+    span->free = obj;
+
+    if (--span->inuse == 0) {
+        partial_remove(span);
+        span->magic = 0;
+        span->next = free_spans;
+        free_spans = span;
+    }
+}
+
+static bool cache_refill(uint32_t class, cache_bin_t* bin) {
+    uint32_t batch = batch_of(class);
+
+    lock();
+    for (uint32_t i = 0; i < batch; i++) {
+        void* obj = central_take(class);
+        if (!obj)
+            break;
+
+        *(void**)obj = bin->head;
+        bin->head = obj;
+        bin->count++;
+    }
+    unlock();
+
+    return bin->head != NULL;
+}
+
+static void cache_flush(cache_bin_t* bin, uint32_t count) {
+    lock();
+    while (count--) {
+        void* obj = bin->head;
+        bin->head = *(void**)obj;
+        bin->count--;
+        central_put(obj);
+    }
+    unlock();
+}
+
+static void* large_alloc(size_t size) {
+    if (size > HEAP_END - HEAP_BASE)
+        return NULL;
+
+    uint64_t bytes = ALIGN_UP(size + SPAN_HEADER, PAGE_SIZE);
+
+    lock();
+    uint64_t addr = heap_reserve(bytes);
+    unlock();
+
+    if (!addr || sys_mmap(addr, bytes, PROT_READ | PROT_WRITE) < 0)
+        return NULL;
+
+    span_t* span = (span_t*)addr;
+    span->magic = SPAN_MAGIC;
+    span->class = SPAN_LARGE;
+    span->pages = bytes / PAGE_SIZE;
+    return (uint8_t*)span + SPAN_HEADER;
+}
+
+void* malloc(size_t size) {
+    if (size > MAX_SMALL)
+        return large_alloc(size);
+
+    uint32_t class = class_of(size ? size : 1);
+    cache_bin_t* bin = &cache[class];
+    if (!bin->head && !cache_refill(class, bin))
+        return NULL;
+
+    void* obj = bin->head;
+    bin->head = *(void**)obj;
+    bin->count--;
+    return obj;
+}
+
+void free(void* ptr) {
+    if (!ptr)
+        return;
+
+    span_t* span = span_of(ptr);
+    if (span->magic != SPAN_MAGIC)
+        __builtin_trap(); // Not ours, or a double free of a whole span
+
+    if (span->class == SPAN_LARGE) {
+        span->magic = 0;
+        sys_munmap((uint64_t)span, span->pages * PAGE_SIZE);
+        return;
+    }
+
+    cache_bin_t* bin = &cache[span->class];
+    *(void**)ptr = bin->head;
+    bin->head = ptr;
+
+    uint32_t batch = batch_of(span->class);
+    if (++bin->count > 2 * batch)
+        cache_flush(bin, batch);
+}
+
+void* calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total))
+        return NULL;
+
+    void* ptr = malloc(total);
+    if (ptr)
+        memset(ptr, 0, total);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (!ptr)
+        return malloc(size);
+
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    span_t* span = span_of(ptr);
+    size_t capacity = span->class == SPAN_LARGE
+                          ? span->pages * PAGE_SIZE - SPAN_HEADER
+                          : class_sizes[span->class];
+    if (size <= capacity)
+        return ptr;
+
+    void* new = malloc(size);
+    if (new) {
+        memcpy(new, ptr, capacity);
+        free(ptr);
+    }
+    return new;
+}
@@ -0,0 +1,160 @@
+/* EMK 1.0 Copyright (c) 2025 Piraterna */
+#include <emk/string.h>
+#include <stdint.h>
+
+/*
+ * Bulk copies and fills use rep movsb/stosb, which every CPU since Ivy
+ * Bridge (ERMS) runs at cache line speed, short ones stay in registers
+ * where the microcode startup cost would dominate. The scans read aligned
+ * words, which never cross into an unmapped page.
+ */
+#define REP_THRESHOLD 64
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) word_t;
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HAS_ZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+void* memcpy(void* restrict dest, const void* restrict src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (n >= REP_THRESHOLD) {
+        __asm__ volatile("rep movsb"
+                         : "+D"(d), "+S"(s), "+c"(n)
+                         :
+                         : "memory");
+        return dest;
+    }
+
+    for (; n >= 8; n -= 8, d += 8, s += 8)
+        *(word_t*)d = *(const word_t*)s;
+    while (n--)
+        *d++ = *s++;
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    /* Forwards is safe unless dest starts inside src */
+    if (d <= s || d >= s + n) {
+        __asm__ volatile("rep movsb"
+                         : "+D"(d), "+S"(s), "+c"(n)
+                         :
+                         : "memory");
+        return dest;
+    }
+
+    d += n - 1;
+    s += n - 1;
+    __asm__ volatile("std\n\t"
+                     "rep movsb\n\t"
+                     "cld"
+                     : "+D"(d), "+S"(s), "+c"(n)
+                     :
+                     : "memory");
+    return dest;
+}
+
+void* memset(void* s, int c, size_t n) {
+    uint8_t* d = s;
+
+    if (n >= REP_THRESHOLD) {
+        __asm__ volatile("rep stosb"
+                         : "+D"(d), "+c"(n)
+                         : "a"(c)
+                         : "memory");
+        return s;
+    }
+
+    uint64_t fill = (uint8_t)c * ONES;
+    for (; n >= 8; n -= 8, d += 8)
+        *(word_t*)d = fill;
+    while (n--)
+        *d++ = (uint8_t)c;
+    return s;
+}
+
+int memcmp(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = s1;
+    const uint8_t* b = s2;
+
+    /* Skip equal words, the bytes sort out which one differs */
+    for (; n >= 8 && *(const word_t*)a == *(const word_t*)b; n -= 8) {
+        a += 8;
+        b += 8;
+    }
+
+    for (; n; n--, a++, b++) {
+        if (*a != *b)
+            return *a - *b;
+    }
+    return 0;
+}
+
+void* memchr(const void* s, int c, size_t n) {
+    const uint8_t* p = s;
+
+    for (; n; n--, p++) {
+        if (*p == (uint8_t)c)
+            return (void*)p;
+    }
+    return NULL;
+}
+
+size_t strlen(const char* str) {
+    const char* p = str;
+
+    for (; (uintptr_t)p & 7; p++) {
+        if (!*p)
+            return p - str;
+    }
+
+    const word_t* w = (const word_t*)p;
+    while (!HAS_ZERO(*w))
+        w++;
+
+    for (p = (const char*)w; *p; p++)
+        ;
+    return p - str;
+}
+
+size_t strnlen(const char* str, size_t max) {
+    size_t len = 0;
+    while (len < max && str[len])
+        len++;
+    return len;
+}
+
+int strcmp(const char* s1, const char* s2) {
+    while (*s1 && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+    return (uint8_t)*s1 - (uint8_t)*s2;
+}
+
+int strncmp(const char* s1, const char* s2, size_t n) {
+    for (; n; n--, s1++, s2++) {
+        if (*s1 != *s2 || !*s1)
+            return (uint8_t)*s1 - (uint8_t)*s2;
+    }
+    return 0;
+}
+
+char* strcpy(char* restrict dest, const char* restrict src) {
+    memcpy(dest, src, strlen(src) + 1);
+    return dest;
+}
+
+char* strchr(const char* s, int c) {
+    for (;; s++) {
+        if (*s == (char)c)
+            return (char*)s;
+        if (!*s)
+            return NULL;
+    }
+}